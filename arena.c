@@ -0,0 +1,63 @@
+/*
+   NoCrazyDots
+   Machine and human readable polyphonic music notation
+   without crazy dots.
+   Supports automated playing and auto-accompainment.
+
+   (c) 2017-2019 Antonio Bonifati aka Farmboy
+   <http://farmboymusicblog.wordpress.com>
+
+   This file is part of NoCrazyDots.
+
+   NoCrazyDots is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   NoCrazyDots is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with NoCrazyDots.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Score-lifetime memory: few big allocations, one bulk release.
+
+#include <stdlib.h>
+#include "arena.h"
+#include "error.h"
+
+#define ALIGNUP(n) (((n) + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1))
+
+void *ncd_arena_alloc(ncd_arena *arena, size_t size) {
+  ncd_arena_block *block = arena->head;
+  void *p;
+
+  size = ALIGNUP(size);
+  if (block == NULL || block->size - block->used < size) {
+    // Oversized requests get a block of their own
+    size_t block_size = size > ARENABLOCK ? size : ARENABLOCK;
+
+    error_if((block = malloc(sizeof(ncd_arena_block) + block_size)) == NULL);
+    block->size = block_size;
+    block->used = 0;
+    block->next = arena->head;
+    arena->head = block;
+  }
+
+  p = (char *)block->data + block->used;
+  block->used += size;
+  return p;
+}
+
+void ncd_arena_free(ncd_arena *arena) {
+  ncd_arena_block *block, *next;
+
+  for (block = arena->head; block; block = next) {
+    next = block->next;
+    free(block);
+  }
+  arena->head = NULL;
+}
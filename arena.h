@@ -0,0 +1,25 @@
+#ifndef NOCRAZYDOTS_ARENA_H
+#define NOCRAZYDOTS_ARENA_H
+
+#include <stddef.h>
+
+// Default size of each memory block requested to the system allocator
+#define ARENABLOCK 65536
+
+typedef struct ncd_arena_block {
+  struct ncd_arena_block *next;
+  size_t size, used;
+  max_align_t data[]; // keeps the payload suitably aligned
+} ncd_arena_block;
+
+/* Bump allocator for data which lives as long as a score: there is
+   no way to free a single allocation, everything is released at once
+   by ncd_arena_free. Initialize with {NULL}. */
+typedef struct {
+  ncd_arena_block *head; // current block, the older ones follow
+} ncd_arena;
+
+void *ncd_arena_alloc(ncd_arena *arena, size_t size);
+void ncd_arena_free(ncd_arena *arena);
+
+#endif
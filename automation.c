@@ -0,0 +1,331 @@
+/*
+   NoCrazyDots
+   Machine and human readable polyphonic music notation
+   without crazy dots.
+   Supports automated playing and auto-accompainment.
+
+   (c) 2017-2019 Antonio Bonifati aka Farmboy
+   <http://farmboymusicblog.wordpress.com>
+
+   This file is part of NoCrazyDots.
+
+   NoCrazyDots is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   NoCrazyDots is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with NoCrazyDots.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Hairpins and slides. Each active ramp knows when its value is going
+   to change next, the player sleeps straight to the earliest of them
+   instead of polling every channel every EXPR_STEP. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "error.h"
+#include "midi.h"
+#include "parser.h"
+#include "queue.h"
+#include "automation.h"
+
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+
+#define MAXPITCH 0x3FFF
+
+// Ramp kinds, one ramp of each kind per channel at most
+enum {HAIRPIN, SLIDE, RAMP_KINDS};
+#define MAXRAMPS (RAMP_KINDS * MIDI_CHANNELS)
+#define NOHEAP 0xFF
+
+/* A linear ramp in steps of EXPR_STEP us. The value at step n is
+   from + n * step, until step n_end, which is exactly to. */
+typedef struct {
+  int64_t start; // time of step 0 in us
+  int64_t next; // time of the next change to send in us
+  int64_t release; // slides only: when the bent note ends
+  float from, step, to;
+  unsigned n, n_end;
+  unsigned char channel, kind;
+  bool holding; // slides only: done sliding, waiting for release
+} ncd_ramp;
+
+static ncd_ramp ramps[MAXRAMPS];
+
+// Active ramps, a binary min-heap on next
+static unsigned char heap[MAXRAMPS], heap_len;
+// Position of each ramp in the heap or NOHEAP
+static unsigned char heap_pos[MAXRAMPS];
+
+#define KEY(i) (ramps[heap[i]].next)
+
+static void heap_swap(unsigned char i, unsigned char j) {
+  unsigned char r = heap[i];
+
+  heap[i] = heap[j];
+  heap[j] = r;
+  heap_pos[heap[i]] = i;
+  heap_pos[heap[j]] = j;
+}
+
+// Restore the heap after the key at position i changed
+static void heap_fix(unsigned char i) {
+  unsigned char child;
+
+  while (i > 0 && KEY(i) < KEY((i - 1) / 2)) {
+    heap_swap(i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+  while ((child = 2 * i + 1) < heap_len) {
+    if (child + 1 < heap_len && KEY(child + 1) < KEY(child)) {
+      child++;
+    }
+    if (KEY(i) <= KEY(child)) {
+      break;
+    }
+    heap_swap(i, child);
+    i = child;
+  }
+}
+
+static void heap_add(unsigned char r) {
+  if (heap_pos[r] == NOHEAP) {
+    heap[heap_pos[r] = heap_len++] = r;
+  }
+  heap_fix(heap_pos[r]);
+}
+
+static void heap_remove(unsigned char r) {
+  unsigned char i = heap_pos[r];
+
+  if (i == NOHEAP) {
+    return;
+  }
+  heap_pos[r] = NOHEAP;
+  if (i != --heap_len) {
+    heap[i] = heap[heap_len];
+    heap_pos[heap[i]] = i;
+    heap_fix(i);
+  }
+}
+
+static float ramp_value(const ncd_ramp *r, unsigned n) {
+  return n >= r->n_end ? r->to : r->from + n * r->step;
+}
+
+// Current value of what the ramp changes
+static float *ramp_current(const ncd_ramp *r) {
+  return r->kind == HAIRPIN ? &ncd_expression[r->channel].current
+    : &ncd_pitch_wheel[r->channel].current;
+}
+
+/* Move to the first step that changes the value actually sent, i.e.
+   its integer part. Return false if there is none left. */
+static bool ramp_advance(ncd_ramp *r) {
+  int sent = (int)*ramp_current(r);
+  float target;
+  unsigned n;
+
+  if (r->n >= r->n_end) {
+    return false;
+  }
+
+  // Guess from the slope, then make sure
+  n = r->n + 1;
+  if (r->step != 0) {
+    target = r->step > 0 ? sent + 1 : sent;
+    if ((target - r->from) / r->step > n) {
+      n = min((unsigned)((target - r->from) / r->step), r->n_end);
+    }
+  } else {
+    n = r->n_end;
+  }
+  while (n < r->n_end && (int)ramp_value(r, n) == sent) {
+    n++;
+  }
+
+  r->n = n;
+  r->next = r->start + (int64_t)n * EXPR_STEP;
+  return (int)ramp_value(r, n) != sent;
+}
+
+// Schedule the next change of ramp number i, if any
+static void ramp_schedule(unsigned char i) {
+  ncd_ramp *r = &ramps[i];
+
+  if (r->holding) {
+    heap_remove(i);
+  } else if (ramp_advance(r)) {
+    heap_add(i);
+  } else if (r->kind == SLIDE) {
+    // Hold the bent pitch until the end of the note
+    r->holding = true;
+    if (r->release > r->next) {
+      r->next = r->release;
+    }
+    heap_add(i);
+  } else {
+    heap_remove(i);
+  }
+}
+
+void ncd_auto_reset() {
+  heap_len = 0;
+  memset(heap_pos, NOHEAP, sizeof(heap_pos));
+}
+
+void ncd_auto_hairpin(const ncd_tl_event *ev) {
+  unsigned char channel = ev->channel, i = channel * RAMP_KINDS + HAIRPIN;
+  ncd_ramp *r = &ramps[i];
+  float final_volume, volume_delta, curr_volume;
+  int64_t duration = ncd_tempo_us(ev->time + ev->duration) - ev->us;
+
+  curr_volume = ncd_expression[channel].current;
+  final_volume = ncd_expression[channel].reference
+    * (100.0 + ev->value) / 100;
+
+  // Volume limiter
+  if (final_volume > 127) {
+    final_volume = 127;
+    warning(ncd_parser_line_no,
+      "warning: expression hairpin on channel %hhu increased volume to a value >127."
+      " Clipped to 127.\nConsider user a smaller percentage.\n",
+      channel + 1);
+  } else if (final_volume < 0) {
+    final_volume = 0;
+    warning(ncd_parser_line_no,
+      "warning: expression hairpin on channel %hhu decreased volume to a value <0."
+      " Clipped to 0.\nConsider user a smaller percentage.\n",
+      channel + 1);
+  }
+
+  volume_delta = final_volume - curr_volume;
+  if (ev->value > 0) {
+    if (volume_delta < 0) {
+      warning(ncd_parser_line_no,
+        "warning: current volume is greater than final crescendo volume. Did you mean a decrescendo?");
+    }
+  } else if (volume_delta > 0) {
+    warning(ncd_parser_line_no,
+      "warning: current volume is less than final decrescendo volume. Did you mean a crescendo?");
+  }
+
+  if (duration < EXPR_STEP) {
+    duration = EXPR_STEP;
+    warning(ncd_parser_line_no,
+      "warning: expression hairpin does not apply: duration too short\n");
+  }
+
+  /* From proportion:
+
+        volume_delta      step
+      ---------------- = -----------
+        duration (us)     EXPR_STEP
+  */
+  r->channel = channel;
+  r->kind = HAIRPIN;
+  r->start = ev->us;
+  r->from = curr_volume;
+  r->to = final_volume;
+  r->step = EXPR_STEP * volume_delta / duration;
+  r->holding = false;
+  r->n = 0;
+  r->n_end = duration / EXPR_STEP;
+  ramp_schedule(i);
+}
+
+void ncd_auto_slide(const ncd_tl_event *ev) {
+  unsigned char channel = ev->channel, i = channel * RAMP_KINDS + SLIDE;
+  ncd_ramp *r = &ramps[i];
+  signed char semitones = ev->value;
+  int64_t duration = ncd_tempo_us(ev->time + ev->duration) - ev->us,
+    slope_duration;
+
+  // TODO: this code assumes the pitch wheel range is only a tone.
+  // see "Errata" at http://midi.teragonaudio.com/tech/midispec/wheel.htm
+  ncd_pitch_wheel[channel].semitones = semitones;
+  if (abs(semitones) > 2) {
+    warning(ncd_parser_line_no,
+      "warning: sliding more than one tone is currently not supported");
+    semitones = semitones > 0 ? 2 : -2;
+  }
+
+  /* Change pitch linearly for
+       slope_duration = min(PITCH_WHEEL_DUR, duration)
+     us and if time is left (note is longer than that), keep it
+     constant until the end of the note, then center the wheel again.
+     The descending slope due to the pitch wheel spring is not
+     implemented. This it is usually faster than a single EXPR_STEP.
+
+     From proportion:
+
+      semitones * 0x1000     step
+     -------------------- = -----------
+        slope_duration       EXPR_STEP
+  */
+  slope_duration = min(PITCH_WHEEL_DUR, duration);
+  if (slope_duration < EXPR_STEP) {
+    slope_duration = EXPR_STEP;
+  }
+  r->channel = channel;
+  r->kind = SLIDE;
+  r->start = ev->us;
+  r->release = ev->us + duration;
+  r->from = NOBENDING;
+  r->to = NOBENDING + semitones * 0x1000;
+  if (r->to > MAXPITCH) {
+    r->to = MAXPITCH;
+  }
+  r->step = (float)EXPR_STEP * semitones * 0x1000 / slope_duration;
+  r->holding = false;
+  r->n = 0;
+  r->n_end = slope_duration / EXPR_STEP;
+  ramp_schedule(i);
+}
+
+// Time of the next change to send, NCD_AUTO_IDLE if none
+int64_t ncd_auto_next() {
+  return heap_len ? KEY(0) : NCD_AUTO_IDLE;
+}
+
+// Send all changes due at ncd_auto_next()
+void ncd_auto_run(ncd_render_send send) {
+  int64_t now = ncd_auto_next();
+  unsigned char i;
+  ncd_midi_event msg;
+  ncd_ramp *r;
+  float *current, new_value;
+  unsigned short value;
+
+  while (heap_len && KEY(0) == now) {
+    r = &ramps[i = heap[0]];
+    current = ramp_current(r);
+    // At the end of the bent note, center the pitch wheel again
+    new_value = r->holding ? NOBENDING : ramp_value(r, r->n);
+
+    // Spare bandwidth... only send a message if the value sent changes
+    if ((int)new_value != (int)*current) {
+      if (r->kind == HAIRPIN) {
+        msg[MIDI_STATUS] = MIDI_CONTROLLER | r->channel;
+        msg[MIDI_DATA1] = MIDI_VOLUME;
+        msg[MIDI_DATA2] = (unsigned char)new_value;
+      } else {
+        value = (unsigned short)new_value;
+        msg[MIDI_STATUS] = MIDI_PITCH_WHEEL | r->channel;
+        msg[MIDI_DATA1] = value & 0x7F;
+        msg[MIDI_DATA2] = (value >> 7) & 0x7F;
+      }
+      send(msg, 3);
+    }
+    *current = new_value;
+
+    ramp_schedule(i);
+  }
+}
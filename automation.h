@@ -0,0 +1,24 @@
+#ifndef NOCRAZYDOTS_AUTOMATION_H
+#define NOCRAZYDOTS_AUTOMATION_H
+
+#include <stdint.h>
+#include "timeline.h"
+#include "player.h"
+
+// Define duration of the pitch wheel ascending slope
+#define PITCH_WHEEL_DUR 150000 // in us
+
+// Volume and pitch wheel changes are sent at most every EXPR_STEP us
+// per channel. Must be a fraction of PITCH_WHEEL_DUR
+#define EXPR_STEP 1500 // e.g. 100000 us = 0.1s
+
+// What ncd_auto_next returns when there is nothing left to change
+#define NCD_AUTO_IDLE INT64_MAX
+
+void ncd_auto_reset();
+void ncd_auto_hairpin(const ncd_tl_event *ev);
+void ncd_auto_slide(const ncd_tl_event *ev);
+int64_t ncd_auto_next();
+void ncd_auto_run(ncd_render_send send);
+
+#endif
@@ -0,0 +1,152 @@
+/*
+   NoCrazyDots
+   Machine and human readable polyphonic music notation
+   without crazy dots.
+   Supports automated playing and auto-accompainment.
+
+   (c) 2017-2019 Antonio Bonifati aka Farmboy
+   <http://farmboymusicblog.wordpress.com>
+
+   This file is part of NoCrazyDots.
+
+   NoCrazyDots is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   NoCrazyDots is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with NoCrazyDots.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Measure how late the kernel wakes us up and how long a write takes
+   on this host with the selected output, and save the results, for the
+   scheduler to start from them. It keeps adapting them while playing. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "error.h"
+#include "midi.h"
+#include "output.h"
+#include "timer.h"
+#include "sender.h"
+#include "rt.h"
+#include "calibrate.h"
+
+static char profile_path[FILENAME_MAX];
+
+// Build the profile file name, creating its directory if asked to
+static const char *profile(bool create) {
+  const char *config = getenv("XDG_CONFIG_HOME"), *home = getenv("HOME");
+  char host[64] = "localhost";
+
+  if (config == NULL || *config == '\0') {
+    error_check(home == NULL, 0, "Cannot find the home directory");
+    snprintf(profile_path, sizeof(profile_path), "%s/.config", home);
+  } else {
+    snprintf(profile_path, sizeof(profile_path), "%s", config);
+  }
+  if (create) {
+    error_if(mkdir(profile_path, 0755) == -1 && errno != EEXIST);
+  }
+  strncat(profile_path, "/" PROFILEDIR,
+    sizeof(profile_path) - strlen(profile_path) - 1);
+  if (create) {
+    error_if(mkdir(profile_path, 0755) == -1 && errno != EEXIST);
+  }
+
+  gethostname(host, sizeof(host) - 1);
+  snprintf(profile_path + strlen(profile_path),
+    sizeof(profile_path) - strlen(profile_path), "/%s.%s", host, ncd_out->name);
+  return profile_path;
+}
+
+static int cmp_us(const void *a, const void *b) {
+  int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+// Median of n values, sorting them
+static int64_t median(int64_t *us, size_t n) {
+  qsort(us, n, sizeof(int64_t), cmp_us);
+  return us[n / 2];
+}
+
+void ncd_calibrate() {
+  static int64_t sleeps[CALIBRATE_SLEEPS], writes[CALIBRATE_WRITES];
+  // Harmless, it is sent anyway when the keyboard is set up
+  unsigned char center[] = {MIDI_PITCH_WHEEL, 0x00, 0x40};
+  int64_t deadline, start;
+  const char *path;
+  FILE *fp;
+  int i;
+
+  // Under the same conditions as when playing
+  ncd_rt_prepare();
+  ncd_rt_pin(pthread_self(), ncd_sender_cpu);
+  ncd_rt_report(pthread_self());
+  ncd_output_open();
+  ncd_timer_start();
+
+  // Measure the plain sleep, with no spin and no correction at all
+  ncd_timer_spin = 0;
+  deadline = ncd_timer_now();
+  for (i = 0; i < CALIBRATE_SLEEPS; i++) {
+    // Vary the length of the sleeps, as notes do
+    deadline += CALIBRATE_PERIOD / 2 + i % 7 * CALIBRATE_PERIOD / 4;
+    ncd_timer_overshoot = 0;
+    sleeps[i] = ncd_timer_sleep_until(deadline);
+  }
+
+  for (i = 0; i < CALIBRATE_WRITES; i++) {
+    deadline += CALIBRATE_PERIOD;
+    ncd_timer_sleep_until(deadline);
+    start = ncd_timer_now();
+    ncd_output_put(center, sizeof(center));
+    ncd_output_flush();
+    writes[i] = ncd_timer_now() - start;
+  }
+  ncd_output_close();
+
+  ncd_timer_overshoot = median(sleeps, CALIBRATE_SLEEPS);
+  ncd_output_write_cost = median(writes, CALIBRATE_WRITES);
+
+  path = profile(true);
+  error_if((fp = fopen(path, "w")) == NULL);
+  fprintf(fp, "overshoot %ld\nwrite %ld\n",
+    (long)ncd_timer_overshoot, (long)ncd_output_write_cost);
+  error_if(fclose(fp) == EOF);
+
+  printf("sleep overshoot: median %ld us, max %ld us\n",
+    (long)ncd_timer_overshoot, (long)sleeps[CALIBRATE_SLEEPS - 1]);
+  printf("write to %s: median %ld us, max %ld us\n", ncd_out->name,
+    (long)ncd_output_write_cost, (long)writes[CALIBRATE_WRITES - 1]);
+  printf("saved to %s\n", path);
+}
+
+// Start from the profile of this host and output, if it was calibrated
+void ncd_calibrate_load() {
+  long overshoot, write;
+  FILE *fp;
+
+  if ((fp = fopen(profile(false), "r")) == NULL) {
+    return;
+  }
+  if (fscanf(fp, "overshoot %ld write %ld", &overshoot, &write) == 2
+      && overshoot >= 0 && write >= 0) {
+    ncd_timer_overshoot = overshoot;
+    ncd_output_write_cost = write;
+  } else {
+    warning(0, "warning: ignoring bad calibration profile %s", profile_path);
+  }
+  fclose(fp);
+}
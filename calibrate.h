@@ -0,0 +1,15 @@
+#ifndef NOCRAZYDOTS_CALIBRATE_H
+#define NOCRAZYDOTS_CALIBRATE_H
+
+#define CALIBRATE_SLEEPS 500 // number of sleeps to measure
+#define CALIBRATE_WRITES 200 // number of writes to measure
+#define CALIBRATE_PERIOD 2000 // us between two measures
+
+/* Profiles are kept in this directory, under $XDG_CONFIG_HOME or
+   ~/.config, one per host and output, e.g. myhost.rawmidi */
+#define PROFILEDIR "nocrazydots"
+
+void ncd_calibrate();
+void ncd_calibrate_load();
+
+#endif
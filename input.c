@@ -0,0 +1,156 @@
+/*
+   NoCrazyDots
+   Machine and human readable polyphonic music notation
+   without crazy dots.
+   Supports automated playing and auto-accompainment.
+
+   (c) 2017-2019 Antonio Bonifati aka Farmboy
+   <http://farmboymusicblog.wordpress.com>
+
+   This file is part of NoCrazyDots.
+
+   NoCrazyDots is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   NoCrazyDots is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with NoCrazyDots.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* MIDI input from the keyboard. Whatever is there is read at once,
+   without blocking, and parsed into complete messages stamped with
+   their arrival time, so that a burst of notes (e.g. a chord) does not
+   delay the ones coming after. */
+
+#include <stdlib.h>
+#include <poll.h>
+#include <errno.h>
+#include "error.h"
+#include "midi.h"
+#include "timer.h"
+#include "input.h"
+
+static ncd_input_event in_ring[INPUTRING];
+static size_t in_head, in_tail;
+
+// Parser state: running status, 0 if none, and data bytes read so far
+static unsigned char in_status, in_data[2], in_data_len;
+
+static struct pollfd *in_fds;
+static int in_fds_len;
+
+// Number of data bytes of the messages with status
+static unsigned char data_size(unsigned char status) {
+  switch (status & 0xF0) {
+    case MIDI_PROGRAM_CHANGE:
+    case 0xD0: // channel pressure
+      return 1;
+    default:
+      return 2;
+  }
+}
+
+static void push(int64_t clock) {
+  ncd_input_event *ev = &in_ring[in_head % INPUTRING];
+
+  ev->msg[MIDI_STATUS] = in_status;
+  ev->msg[MIDI_DATA1] = in_data[0];
+  ev->msg[MIDI_DATA2] = in_data_len > 1 ? in_data[1] : 0;
+  ev->size = 1 + in_data_len;
+  ev->clock = clock;
+  if ((in_status & 0xF0) == MIDI_NOTEON && ev->msg[MIDI_DATA2] == 0) {
+    ev->msg[MIDI_STATUS] = MIDI_NOTEOFF | (in_status & 0x0F);
+  }
+
+  if (++in_head - in_tail > INPUTRING) {
+    in_tail++; // too late to be of any use
+  }
+}
+
+// Feed the received bytes to the parser
+static void parse(const unsigned char *bytes, size_t size, int64_t clock) {
+  size_t i;
+
+  for (i = 0; i < size; i++) {
+    if (bytes[i] >= 0xF8) {
+      // Real time messages (clock, active sensing...) may come anywhere
+      continue;
+    } else if (bytes[i] >= 0xF0) {
+      // System common and exclusive ones cancel the running status
+      in_status = 0;
+    } else if (bytes[i] & 0x80) {
+      in_status = bytes[i];
+      in_data_len = 0;
+    } else if (in_status) {
+      in_data[in_data_len++] = bytes[i];
+      if (in_data_len == data_size(in_status)) {
+        push(clock);
+        in_data_len = 0; // the status is still running
+      }
+    }
+  }
+}
+
+void ncd_input_open() {
+  error_check(midiin == NULL, 0, "MIDI input needs a keyboard, use -out rawmidi");
+  CHK(snd_rawmidi_nonblock(midiin, 1));
+  in_fds_len = snd_rawmidi_poll_descriptors_count(midiin);
+  error_if((in_fds = calloc(in_fds_len, sizeof(struct pollfd))) == NULL);
+  snd_rawmidi_poll_descriptors(midiin, in_fds, in_fds_len);
+  in_head = in_tail = 0;
+  in_status = in_data_len = 0;
+}
+
+/* Wait up to timeout ms (-1 for ever) for input, then read all there is.
+   Return whether there are messages to take. */
+bool ncd_input_poll(int timeout) {
+  unsigned char bytes[INPUTREAD];
+  ssize_t n;
+  int64_t clock;
+
+  if (in_head == in_tail) {
+    while (poll(in_fds, in_fds_len, timeout) == -1) {
+      error_if(errno != EINTR);
+    }
+  }
+
+  clock = ncd_timer_clock();
+  while ((n = snd_rawmidi_read(midiin, bytes, sizeof(bytes))) > 0) {
+    parse(bytes, n, clock);
+  }
+  if (n < 0 && n != -EAGAIN) {
+    CHK(n);
+  }
+
+  return in_head != in_tail;
+}
+
+// Take the oldest message received, if any
+bool ncd_input_next(ncd_input_event *ev) {
+  if (in_head == in_tail) {
+    return false;
+  }
+  *ev = in_ring[in_tail++ % INPUTRING];
+  return true;
+}
+
+// Wait for a note on or off, throwing away the other messages
+void ncd_input_wait_note(ncd_input_event *ev) {
+  unsigned char status;
+
+  while (1) {
+    while (ncd_input_next(ev)) {
+      status = ev->msg[MIDI_STATUS] & 0xF0;
+      if (status == MIDI_NOTEON || status == MIDI_NOTEOFF) {
+        return;
+      }
+    }
+    ncd_input_poll(-1);
+  }
+}
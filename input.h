@@ -0,0 +1,25 @@
+#ifndef NOCRAZYDOTS_INPUT_H
+#define NOCRAZYDOTS_INPUT_H
+
+#include <stdint.h>
+#include "midi.h"
+
+// Messages received but not yet taken (power of 2). The oldest are lost
+#define INPUTRING 256
+
+// Bytes taken from the keyboard with a single read
+#define INPUTREAD 256
+
+// A channel message from the keyboard
+typedef struct {
+  ncd_midi_event msg; // note ons with velocity 0 are turned into note offs
+  unsigned char size;
+  int64_t clock; // when it arrived, see ncd_timer_clock
+} ncd_input_event;
+
+void ncd_input_open();
+bool ncd_input_poll(int timeout);
+bool ncd_input_next(ncd_input_event *ev);
+void ncd_input_wait_note(ncd_input_event *ev);
+
+#endif
@@ -0,0 +1,109 @@
+/*
+   NoCrazyDots
+   Machine and human readable polyphonic music notation
+   without crazy dots.
+   Supports automated playing and auto-accompainment.
+
+   (c) 2017-2019 Antonio Bonifati aka Farmboy
+   <http://farmboymusicblog.wordpress.com>
+
+   This file is part of NoCrazyDots.
+
+   NoCrazyDots is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   NoCrazyDots is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with NoCrazyDots.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Feed score characters to the parser without going through stdio.
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "lexer.h"
+#include "error.h"
+
+const unsigned char *ncd_lex_cur, *ncd_lex_end;
+
+static int lex_fd;
+// Whole score when it is a regular file, NULL otherwise
+static unsigned char *lex_map;
+static size_t lex_map_len;
+static unsigned char lex_buf[LEXBUFSIZE];
+static bool lex_eof;
+// Start of the current window and last character of the previous one
+static const unsigned char *lex_start;
+static int lex_last;
+
+void ncd_lex_open(FILE *fp) {
+  struct stat st;
+
+  lex_fd = fileno(fp);
+  lex_eof = false;
+  lex_last = '\n';
+  lex_map = NULL;
+  ncd_lex_cur = ncd_lex_end = lex_start = lex_buf;
+
+  error_if(fstat(lex_fd, &st) == -1);
+  if (S_ISREG(st.st_mode) && st.st_size > 0) {
+    lex_map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, lex_fd, 0);
+    if (lex_map == MAP_FAILED) {
+      // Fall back to read(2), e.g. on file systems without mmap support
+      lex_map = NULL;
+    } else {
+      lex_map_len = st.st_size;
+      madvise(lex_map, lex_map_len, MADV_SEQUENTIAL);
+      ncd_lex_cur = lex_start = lex_map;
+      ncd_lex_end = lex_map + lex_map_len;
+    }
+  }
+}
+
+// Called by NCD_LEX_GETC when the window is exhausted.
+int ncd_lex_refill() {
+  ssize_t n;
+
+  if (ncd_lex_end > lex_start) {
+    lex_last = ncd_lex_end[-1];
+    lex_start = ncd_lex_end;
+  }
+
+  if (!lex_map && !lex_eof) {
+    do {
+      n = read(lex_fd, lex_buf, LEXBUFSIZE);
+    } while (n == -1 && errno == EINTR);
+    error_if(n == -1);
+    if (n > 0) {
+      ncd_lex_cur = lex_start = lex_buf;
+      ncd_lex_end = lex_buf + n;
+      return *ncd_lex_cur++;
+    }
+    lex_eof = true;
+  }
+  /* The parser expects EOF right after a newline only, hand out
+     a newline if the last line of the score is not terminated. */
+  if (lex_last != '\n') {
+    lex_last = '\n';
+    return '\n';
+  }
+  return EOF;
+}
+
+void ncd_lex_close() {
+  if (lex_map) {
+    munmap(lex_map, lex_map_len);
+    lex_map = NULL;
+  }
+  ncd_lex_cur = ncd_lex_end = NULL;
+}
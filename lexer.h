@@ -0,0 +1,23 @@
+#ifndef NOCRAZYDOTS_LEXER_H
+#define NOCRAZYDOTS_LEXER_H
+
+#include <stdio.h>
+
+// Size of each read(2) chunk when the score cannot be memory-mapped
+// (stdin, pipes, terminals).
+#define LEXBUFSIZE 65536
+
+// Window of score bytes not yet consumed by the parser.
+extern const unsigned char *ncd_lex_cur, *ncd_lex_end;
+
+void ncd_lex_open(FILE *fp);
+int ncd_lex_refill();
+void ncd_lex_close();
+
+/* Return the next character of the score or EOF. The fast path is a
+   pointer bump, no stdio call per character. The value is unsigned
+   like the one returned by getc. */
+#define NCD_LEX_GETC() \
+  (ncd_lex_cur < ncd_lex_end ? *ncd_lex_cur++ : ncd_lex_refill())
+
+#endif
@@ -41,6 +41,9 @@ http://www.alsa-project.org/alsa-doc/alsa-lib/_2test_2rawmidi_8c-example.html
 #include <search.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "midi.h"
 #include "parser.h"
 #include "queue.h"
@@ -57,10 +60,6 @@ http://www.alsa-project.org/alsa-doc/alsa-lib/_2test_2rawmidi_8c-example.html
    return to normal (non- active sensing) operation.
 */
 #define MIDI_SENSING 0xFE
-#define MIDI_PROGRAM_CHANGE 0xC0
-#define MIDI_ALL_NOTES_OFF 0x7B
-#define MIDI_SNDBANK_MSB 0x00
-#define MIDI_SNDBANK_LSB 0x20
 
 #define MAXVOICELEN 50
 #define MAXVOICES 1024
@@ -71,8 +70,6 @@ http://www.alsa-project.org/alsa-doc/alsa-lib/_2test_2rawmidi_8c-example.html
 #define MAXPATHLEN 256
 #define DRUMFILEEXT ".txt"
 
-#define DEFVOLUME 100 // default MIDI volume [0..127]
-
 extern char *ncd_pname;
 
 char ncd_midi_port_name[DEVMAXLEN] = "";
@@ -265,6 +262,7 @@ void ncd_midi_set_voice(const char *voice, unsigned char channel,
     ncd_queue_push_event(ev);
   } else {
     NCD_MIDI_EVENT(ev.msg);
+    ncd_output_flush();
   }
   
   // We assume you can only use one drumkit per score
@@ -275,32 +273,66 @@ void ncd_midi_set_voice(const char *voice, unsigned char channel,
   }
 }
 
-void INThandler(int sig) {
-  ncd_midi_all_notes_off();
-  snd_rawmidi_close(midiin);
-  snd_rawmidi_close(midiout);
-  midiin  = NULL;    // snd_rawmidi_close() does not clear invalid pointer,
-  midiout = NULL;    // so might be a good idea to erase it after closing.
-  exit(0); 
+/* Self-pipe: the interrupt handler only writes a byte to it, which is
+   safe in a signal handler, and stopper does the rest. */
+static int stop_pipe[2];
+
+static void INThandler(int sig) {
+  int saved_errno = errno;
+  char byte = 0;
+
+  if (write(stop_pipe[1], &byte, 1) == -1) {
+    // Nothing else can be done here, the pipe is never full anyway
+  }
+  errno = saved_errno;
+}
+
+// Silence the notes still sounding and quit, once interrupted
+static void *stopper(void *arg) {
+  char byte;
+
+  while (read(stop_pipe[0], &byte, 1) == -1 && errno == EINTR);
+  ncd_output_stop();
+  exit(0);
 }
 
-void ncd_midi_init(char* portname) {
+// Initial state of all channels, also when no device is going to be opened
+void ncd_midi_init_channels() {
   register int channel;
 
-  if (! (*ncd_midi_port_name)) {
-    ncd_midi_detect_keyboard_device();
+  for (channel = 0; channel < MIDI_CHANNELS; channel++) {
+    ncd_expression[channel].reference = ncd_expression[channel].current
+      = DEFVOLUME;
+    ncd_pitch_wheel[channel].current = NOBENDING;
   }
+}
 
-  CHK(snd_rawmidi_open(&midiin, &midiout, ncd_midi_port_name, SND_RAWMIDI_SYNC));
-  signal(SIGINT, INThandler);
-
+void ncd_midi_init(char* portname) {
+  register int channel;
+  struct sigaction sa;
+  pthread_t stopper_thread;
+
+  ncd_output_open();
+
+  error_if(pipe(stop_pipe) == -1);
+  error_if((errno = pthread_create(&stopper_thread, NULL, stopper, NULL)) != 0);
+  pthread_detach(stopper_thread);
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = INThandler;
+  // Whatever the interrupted thread was doing goes on until stopper exits
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  error_if(sigaction(SIGINT, &sa, NULL) == -1);
+
+  ncd_midi_init_channels();
   for (channel = 0; channel < MIDI_CHANNELS; channel++) {
-    ncd_midi_set_volume(ncd_expression[channel].reference = DEFVOLUME, channel);
+    ncd_midi_set_volume(DEFVOLUME, channel);
     ncd_midi_pitch_wheel(ncd_pitch_wheel[channel].current = NOBENDING, channel);
 
     // TODO: 2 must be changed to 24 to allow more than one tone of pitch bending
     ncd_pitch_bend_sensitivity(2, channel);
   }
+  ncd_output_flush();
 }
 
 // This implementation handles correctly only the types of messages generated
@@ -456,57 +488,6 @@ void ncd_midi_dump() {
     }
   }
 }
- 
-ncd_midi_event *ncd_midi_wait_note() {
-  static ncd_midi_event e;
-  unsigned char status;
-  while (1) {
-    CHK(snd_rawmidi_read(midiin, &e[MIDI_STATUS], 1));
-
-    status = e[MIDI_STATUS] & 0xF0;
-    if (status == MIDI_NOTEON || status == MIDI_NOTEOFF) {
-      CHK(snd_rawmidi_read(midiin, &e[MIDI_DATA1], 1));
-      CHK(snd_rawmidi_read(midiin, &e[MIDI_DATA2], 1));
-
-      // DEBUG
-      /*printf("<- %02hhx %hhu%s %02hhx ", e[MIDI_STATUS],
-        MIDI_OCTAVE(e[MIDI_DATA1]),
-        midi_note_no_name[MIDI_NOTE_NO(e[MIDI_DATA1])],
-        e[MIDI_DATA2]);*/
-
-      return &e;
-    }
-  }
-}
-
-bool ncd_midi_same_event(ncd_midi_event e1, ncd_midi_event e2) {
-  // Ignore channel number the note arrives from.
-  unsigned char status1 = e1[MIDI_STATUS] & 0xF0,
-    status2 = e2[MIDI_STATUS] & 0xF0;
-  
-  return e1[MIDI_DATA1] == e2[MIDI_DATA1]
-
-    && ((e1[MIDI_DATA2] > 0 && e2[MIDI_DATA2] > 0) || (e1[MIDI_DATA2] == e2[MIDI_DATA2]))
-
-    && (status1 == status2
-         // Some keyboards send MIDI_NOTEOFF messages as MIDI_NOTEON with 0 velocity.
-         || (status1 == MIDI_NOTEOFF && status2 == MIDI_NOTEON && e2[MIDI_DATA2] == 0)
-         || (status2 == MIDI_NOTEOFF && status1 == MIDI_NOTEON && e1[MIDI_DATA2] == 0));
-}
-
-// useful to silence stuck notes
-void ncd_midi_all_notes_off() {
-  unsigned char channel;
-  ncd_midi_event e;
-	
-  for (channel = 0; channel < MIDI_CHANNELS; channel++) {
-    e[MIDI_STATUS] = MIDI_CONTROLLER | channel;
-    e[MIDI_DATA1] = MIDI_ALL_NOTES_OFF;
-    e[MIDI_DATA2] = 0x00;
-    
-    NCD_MIDI_EVENT(e);
-  }
-}
 
 void ncd_midi_detect_keyboard_device() {
   snd_ctl_t *ctl;
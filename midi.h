@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include <alsa/asoundlib.h>
+#include "output.h"
 
 // defaut octave (from 0 to 10, 5 is middle)
 #define DEFOCTAVE 5
@@ -20,6 +21,7 @@
 #define FFFF 127
 
 #define DEFVELOCITY MP
+#define DEFVOLUME 100 // default MIDI volume [0..127]
 #define DEFDURATION 0.25 // 0.25 = quarter note
 
 #define MIDI_CHANNELS 16
@@ -40,12 +42,6 @@ typedef struct {
   // Current volume level. Float so to not amplify rounding errors
   // during hairpins.
   float current;
-
-  // How much to lower/bump up volume every EXPR_STEP ms
-  // negative values for decrescendo
-  float volume_step;
-
-  float left_duration; // Hairpin duration left so far
 } ncd_volume;
 // State of hairpin for each channel.
 extern ncd_volume ncd_expression[MIDI_CHANNELS];
@@ -57,12 +53,6 @@ typedef struct {
   // Current pitch wheel value. Float so to not amplify rounding
   // errors during slides.
   float current;
-
-  // How much to lower/bump up pitch every EXPR_STEP ms
-  // negative values for sliding down
-  float value_step;
-
-  float left_duration; // Slide duration left so far
 } ncd_pitch;
 // State of pitch wheel for each channel.
 extern ncd_pitch ncd_pitch_wheel[MIDI_CHANNELS];
@@ -95,6 +85,9 @@ extern char *midi_drum_name[128];
 #define MIDI_EXPRESSION_MSB 0x0B
 #define MIDI_EXPRESSION_LSB 0x2B
 #define MIDI_PITCH_WHEEL 0xE0
+#define MIDI_PROGRAM_CHANGE 0xC0
+#define MIDI_SNDBANK_MSB 0x00
+#define MIDI_SNDBANK_LSB 0x20
 
 /* [0]: high nibble: event type (NOTEON, NOTEOFF, etc.); low nibble: channel
    [1]: data byte 1 (es. pitch)
@@ -110,6 +103,7 @@ enum {MIDI_STATUS, MIDI_DATA1, MIDI_DATA2, MIDI_DATA3};
 extern struct hsearch_data ncd_midi_voice_table, ncd_midi_drum_table;
 
 void ncd_midi_init();
+void ncd_midi_init_channels();
 void ncd_midi_load_voices(char *datadir);
 void ncd_midi_load_drumkit(char *name);
 void ncd_midi_set_tempo(unsigned char bpm);
@@ -117,8 +111,10 @@ void ncd_midi_set_voice(const char *voice, unsigned char channel,
   unsigned char volume, bool queue);
 int ncd_midi_event_size(ncd_midi_event e);
 
+/* Send the first size bytes of a MIDI event. They are actually written
+   by the next ncd_output_flush, along with everything sent before. */
 #ifdef DEBUG
-  #define NCD_MIDI_EVENT(e) { \
+  #define NCD_MIDI_PRINT(e) { \
     printf("-> %02hhx %02hhx %02hhx\t", \
       (e)[MIDI_STATUS], (e)[MIDI_DATA1], (e)[MIDI_DATA2]); \
     if (((e)[MIDI_STATUS] & 0xF0) == MIDI_CONTROLLER \
@@ -133,11 +129,15 @@ int ncd_midi_event_size(ncd_midi_event e);
             midi_note_no_name[MIDI_NOTE_NO((e)[MIDI_DATA1])], \
             (e)[MIDI_DATA2]); \
     } \
-    CHK(snd_rawmidi_write(midiout, (e), ncd_midi_event_size(e))); \
+  }
+  #define NCD_MIDI_WRITE(e, size) { \
+    NCD_MIDI_PRINT(e); \
+    ncd_output_put((e), (size)); \
   }
 #else
-  #define NCD_MIDI_EVENT(e) CHK(snd_rawmidi_write(midiout, (e), ncd_midi_event_size(e)))
+  #define NCD_MIDI_WRITE(e, size) ncd_output_put((e), (size))
 #endif
+#define NCD_MIDI_EVENT(e) NCD_MIDI_WRITE(e, ncd_midi_event_size(e))
 
 void ncd_midi_noteon(unsigned char note, unsigned char velocity,
   unsigned char channel);
@@ -152,9 +152,6 @@ void ncd_midi_stop_rpn(unsigned char channel);
 void ncd_pitch_bend_sensitivity(unsigned char semitones, unsigned char channel);
 unsigned char ncd_midi_drum_no(char *effect_acronym);
 void ncd_midi_dump();
-bool ncd_midi_same_event(ncd_midi_event e1, ncd_midi_event e2);
-void ncd_midi_all_notes_off();
-ncd_midi_event *ncd_midi_wait_note();
 void ncd_midi_detect_keyboard_device();
 
 #endif
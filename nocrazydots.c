@@ -24,24 +24,27 @@
 */
 #define VERSION 1.1
 
-// Seconds to wait for MIDI recording to finish
-#define WAITMIDI 1
-
-// Including the null byte used to end the command string
-#define MAXCMDLEN 255
-
+#define _GNU_SOURCE // for CPU_SETSIZE
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 #include <string.h>
 #include <libgen.h>
 #include <stdbool.h>
-#include <unistd.h>
+#include <ctype.h>
+#include <limits.h>
 #include <sched.h>
-#include <signal.h>
+#include <unistd.h>
 #include "parser.h"
 #include "midi.h"
 #include "queue.h"
+#include "timeline.h"
+#include "player.h"
+#include "timer.h"
+#include "smf.h"
+#include "sender.h"
+#include "stats.h"
+#include "calibrate.h"
 #include "error.h"
 
 char *ncd_pname;
@@ -52,11 +55,38 @@ const char *filename_ext(const char *filename) {
   return dot + 1;
 }
 
+// The argument of an option taking a number, which cannot be negative
+unsigned long long number_arg(char *arg, char *msg) {
+  char *end;
+  unsigned long long n;
+
+  error_check(!arg || !isdigit((unsigned char)*arg), 0, msg);
+  n = strtoull(arg, &end, 10);
+  error_check(*end != '\0', 0, msg);
+  return n;
+}
+
+// A CPU number, small enough to be in a cpu_set_t
+int cpu_arg(char *arg) {
+  unsigned long long n = number_arg(arg,
+    "-cpu needs a CPU number, starting from 0");
+
+  error_check(n >= CPU_SETSIZE, 0, "No such CPU, see -cpu");
+  return n;
+}
+
+// A bar number, counting from 1 as 0 stands for no bar given
+unsigned bar_arg(char *arg, char *msg) {
+  unsigned long long n = number_arg(arg, msg);
+
+  error_check(n == 0 || n > UINT_MAX, 0, msg);
+  return n;
+}
+
 int main(int argc, char *argv[]) {
   char *datadir = MIDIDATADIR, tag = ' ', last, *midifile = NULL;
   FILE *fp = stdin;
-  bool dump_mode = false;
-  struct sched_param sp;
+  bool dump_mode = false, calibrate = false, seeded = false;
 
   printf("NoCrazyDots %.1f (c) 2017-2019 Antonio Bonifati \"Farmboy\" under GNU GPL3\n",
     VERSION);
@@ -71,6 +101,39 @@ int main(int argc, char *argv[]) {
       tag = (*argv)[0];
     } else if (STREQ2(*argv, "-dump", "-d")) {
       dump_mode = true;
+    } else if (STREQ(*argv, "-out")) {
+      error_check(!*++argv, 0, "-out needs an output, e.g. -out null");
+      ncd_output_select(*argv);
+    } else if (STREQ(*argv, "-stats")) {
+      ncd_stats_report_enabled = true;
+    } else if (STREQ(*argv, "-csv")) {
+      error_check(!*++argv, 0, "-csv needs a file name");
+      ncd_stats_csv = *argv;
+    } else if (STREQ(*argv, "-nosync")) {
+      ncd_output_sync = false;
+    } else if (STREQ(*argv, "-running")) {
+      ncd_output_running_status = true;
+    } else if (STREQ(*argv, "-format0")) {
+      ncd_smf_format = 0;
+    } else if (STREQ(*argv, "-from")) {
+      ncd_from_bar = bar_arg(*++argv,
+        "-from needs a bar number, starting from 1");
+    } else if (STREQ(*argv, "-to")) {
+      ncd_to_bar = bar_arg(*++argv,
+        "-to needs a bar number, starting from 1");
+    } else if (STREQ(*argv, "-window")) {
+      ncd_follow_window = number_arg(*++argv,
+        "-window needs a number of steps");
+    } else if (STREQ(*argv, "-seed")) {
+      ncd_random_seed = number_arg(*++argv, "-seed needs a number");
+      seeded = true;
+    } else if (STREQ(*argv, "-cpu")) {
+      ncd_sender_cpu = cpu_arg(*++argv);
+    } else if (STREQ(*argv, "-calibrate")) {
+      calibrate = true;
+    } else if (STREQ(*argv, "-spin")) {
+      ncd_timer_spin = number_arg(*++argv,
+        "-spin needs a number of microseconds");
     } else if (last == '%') {
       ncd_percent_randomness = atoi(*argv);
     } else if ((*argv)[0] == '+' || (*argv)[0] == '-') {
@@ -78,21 +141,41 @@ int main(int argc, char *argv[]) {
     } else if (last == '/') {
       datadir = *argv;
     } else if (STREQ(filename_ext(*argv), "mid")) {
-      // MIDI file generation implies outputting on a virtual MIDI port
-      strcpy(ncd_midi_port_name, "virtual");
       midifile = *argv;
     } else {
       error_if((fp = fopen(*argv, "r")) == NULL);
     }
   }
 
-  // Try to run in real-time context to reduce latency.
-  sp.sched_priority = 98;
-  if (sched_setscheduler(getpid(), SCHED_FIFO, &sp) == -1) {
-    warning(0, "warning: cannot gain realtime privileges. See README.md");
+  if (!seeded) {
+    // Unpredictable, but tell how to play the same velocities again
+    ncd_random_seed = time(NULL) ^ (uint64_t)getpid() << 32;
+    if (ncd_percent_randomness) {
+      printf("Random seed: %llu\n", (unsigned long long)ncd_random_seed);
+    }
+  }
+
+  if (midifile) {
+    // Rendered offline, no device nor real-time context needed
+    error_check(ncd_from_bar || ncd_to_bar, 0,
+      "-from and -to are for playing only, not for writing MIDI files");
+    ncd_midi_init_channels();
+    ncd_midi_load_voices(datadir);
+    ncd_parse(fp);
+    ncd_timeline_build();
+    ncd_smf_write(midifile);
+    ncd_queue_free();
+    return EXIT_SUCCESS;
+  }
+
+  if (calibrate) {
+    ncd_calibrate();
+    return EXIT_SUCCESS;
   }
+  ncd_calibrate_load();
 
-  srand(time(NULL)); // for unpredictable random numbers
+  error_check((dump_mode || tag != ' ') && ncd_out != &ncd_output_rawmidi, 0,
+    "Dump and auto-accompaniment need a MIDI keyboard, use -out rawmidi");
   ncd_midi_init();
   
   if (dump_mode) {
@@ -104,38 +187,17 @@ int main(int argc, char *argv[]) {
     #ifdef DEBUG
     ncd_queue_display();
     #endif
+    ncd_timeline_build();
 
     if (tag == ' ') {
-      if (midifile) {
-        pid_t recpid;
-        
-        if ((recpid = fork()) == 0) {
-          char reccmd[MAXCMDLEN];
-          snprintf(reccmd, sizeof(reccmd),
-            "arecordmidi -p $(arecordmidi -l | sed -n '$s/ .*//p') \"%s\"",
-            midifile);
-
-          // Child process
-          error_if(execl("/bin/sh", "sh", "-c", reccmd, (char *) 0) == -1);
-        }
-
-        // To be practically sure the first notes have been recorded
-        sleep(WAITMIDI);
-
-        // Parent process
-        ncd_play();
-
-        // To be practically sure the last notes have been recorded
-        sleep(WAITMIDI);
-
-        kill(recpid, SIGINT); // Stop MIDI recorder
-      } else {  
-        ncd_play();
-      }
+      ncd_play();
     } else {
       ncd_auto_accompaniment(tag);
     }
+    ncd_stats_report();
+    ncd_queue_free();
   }
+  ncd_output_close();
   
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,354 @@
+/*
+   NoCrazyDots
+   Machine and human readable polyphonic music notation
+   without crazy dots.
+   Supports automated playing and auto-accompainment.
+
+   (c) 2017-2019 Antonio Bonifati aka Farmboy
+   <http://farmboymusicblog.wordpress.com>
+
+   This file is part of NoCrazyDots.
+
+   NoCrazyDots is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   NoCrazyDots is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with NoCrazyDots.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Output backends: the MIDI keyboard, or somewhere else to play scores
+   without one, e.g. to test or benchmark the player. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include "midi.h"
+#include "timer.h"
+#include "error.h"
+#include "output.h"
+
+const ncd_output *ncd_out = &ncd_output_rawmidi;
+
+bool ncd_output_sync = true, ncd_output_running_status = false;
+int64_t ncd_output_write_cost = 0;
+
+// Bytes put but not yet written
+static unsigned char out_buf[OUTBUFSIZE];
+static size_t out_len;
+// Status byte in effect at the end of out_buf, 0 if none
+static unsigned char out_status;
+
+/* Notes sounding on the output, one bit per note of each channel, as
+   they are written. Only touched holding out_lock, as is the output. */
+static uint64_t out_notes[MIDI_CHANNELS][128 / 64];
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// What follows the colon in the -out option
+static const char *output_arg;
+
+// Trace and file sinks
+static FILE *output_fp;
+static int output_fd = -1;
+
+/* The keyboard, through ALSA */
+
+static void rawmidi_open(const char *arg) {
+  if (! (*ncd_midi_port_name)) {
+    ncd_midi_detect_keyboard_device();
+  }
+
+  CHK(snd_rawmidi_open(&midiin, &midiout, ncd_midi_port_name,
+    ncd_output_sync ? SND_RAWMIDI_SYNC : 0));
+}
+
+static void rawmidi_write(const unsigned char *bytes, size_t size) {
+  CHK(snd_rawmidi_write(midiout, bytes, size));
+}
+
+static void rawmidi_drain() {
+  CHK(snd_rawmidi_drain(midiout));
+}
+
+static void rawmidi_close() {
+  if (midiin) {
+    snd_rawmidi_close(midiin);
+  }
+  if (midiout) {
+    snd_rawmidi_close(midiout);
+  }
+  midiin  = NULL;    // snd_rawmidi_close() does not clear invalid pointer,
+  midiout = NULL;    // so might be a good idea to erase it after closing.
+}
+
+const ncd_output ncd_output_rawmidi = {
+  "rawmidi", rawmidi_open, rawmidi_write, rawmidi_drain, rawmidi_close
+};
+
+/* Throw everything away */
+
+static void null_open(const char *arg) {}
+
+static void null_write(const unsigned char *bytes, size_t size) {}
+
+static void null_drain() {}
+
+static void null_close() {}
+
+const ncd_output ncd_output_null = {
+  "null", null_open, null_write, null_drain, null_close
+};
+
+/* One line per write: microseconds since the start and bytes in hex.
+   Goes to stdout unless a file name is given. */
+
+static void trace_open(const char *arg) {
+  // Until playback starts, time the setup messages from here
+  ncd_timer_start();
+  output_fp = stdout;
+  if (arg) {
+    error_if((output_fp = fopen(arg, "w")) == NULL);
+  }
+}
+
+static void trace_write(const unsigned char *bytes, size_t size) {
+  fprintf(output_fp, "%lld\t", (long long)ncd_timer_now());
+  while (size--) {
+    fprintf(output_fp, size ? "%02x " : "%02x\n", *bytes++);
+  }
+}
+
+static void trace_drain() {
+  error_if(fflush(output_fp) == EOF);
+}
+
+static void trace_close() {
+  if (output_fp && output_fp != stdout) {
+    error_if(fclose(output_fp) == EOF);
+  }
+  output_fp = NULL;
+}
+
+const ncd_output ncd_output_trace = {
+  "trace", trace_open, trace_write, trace_drain, trace_close
+};
+
+/* The same in binary, one record per write: the time as a 64-bit
+   integer and the size as a 16-bit one, both in host byte order, then
+   the bytes. */
+
+static void tracebin_open(const char *arg) {
+  error_check(arg == NULL, 0, "Binary trace needs a file name, e.g. tracebin:FILE");
+  // Until playback starts, time the setup messages from here
+  ncd_timer_start();
+  error_if((output_fp = fopen(arg, "wb")) == NULL);
+}
+
+static void tracebin_write(const unsigned char *bytes, size_t size) {
+  int64_t us = ncd_timer_now();
+  uint16_t len = size;
+
+  error_if(fwrite(&us, sizeof(us), 1, output_fp) != 1);
+  error_if(fwrite(&len, sizeof(len), 1, output_fp) != 1);
+  error_if(fwrite(bytes, 1, size, output_fp) != size);
+}
+
+const ncd_output ncd_output_tracebin = {
+  "tracebin", tracebin_open, tracebin_write, trace_drain, trace_close
+};
+
+/* Raw MIDI bytes, to a file or to a character device like /dev/midi1 */
+
+static void file_open(const char *arg) {
+  error_check(arg == NULL, 0, "File output needs a file name, e.g. file:FILE");
+  error_if((output_fd = open(arg, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1);
+}
+
+static void file_write(const unsigned char *bytes, size_t size) {
+  ssize_t n;
+
+  while (size) {
+    if ((n = write(output_fd, bytes, size)) == -1) {
+      error_if(errno != EINTR);
+      continue;
+    }
+    bytes += n;
+    size -= n;
+  }
+}
+
+static void file_drain() {}
+
+static void file_close() {
+  if (output_fd != -1) {
+    error_if(close(output_fd) == -1);
+  }
+  output_fd = -1;
+}
+
+const ncd_output ncd_output_file = {
+  "file", file_open, file_write, file_drain, file_close
+};
+
+static const ncd_output *outputs[] = {
+  &ncd_output_rawmidi, &ncd_output_null, &ncd_output_trace,
+  &ncd_output_tracebin, &ncd_output_file, NULL
+};
+
+// spec is a backend name, optionally followed by a colon and an argument
+void ncd_output_select(const char *spec) {
+  const ncd_output **o;
+  const char *colon = strchr(spec, ':');
+  size_t len = colon ? (size_t)(colon - spec) : strlen(spec);
+
+  for (o = outputs; *o; o++) {
+    if (strlen((*o)->name) == len && strncmp((*o)->name, spec, len) == 0) {
+      ncd_out = *o;
+      output_arg = colon ? colon + 1 : NULL;
+      return;
+    }
+  }
+
+  trigger_error(0, "Unknown output `%s'. Try rawmidi, null, trace, tracebin or file", spec);
+}
+
+void ncd_output_open() {
+  out_len = 0;
+  out_status = 0;
+  ncd_out->open(output_arg);
+}
+
+// Add a message to the bytes to be written by the next flush
+void ncd_output_put(const unsigned char *bytes, size_t size) {
+  if (out_len + size > OUTBUFSIZE) {
+    ncd_output_flush();
+  }
+
+  if (bytes[0] < 0xF0 && bytes[0] == out_status
+      && ncd_output_running_status) {
+    bytes++;
+    size--;
+  } else if (bytes[0] < 0xF8) {
+    // System common messages cancel the running status, real time ones do not
+    out_status = bytes[0] < 0xF0 ? bytes[0] : 0;
+  }
+
+  memcpy(out_buf + out_len, bytes, size);
+  out_len += size;
+}
+
+// Throw away the bytes put since the last flush
+void ncd_output_discard() {
+  out_len = 0;
+  out_status = 0;
+}
+
+// Update out_notes with the bytes about to be written
+static void track_notes(const unsigned char *bytes, size_t size) {
+  unsigned char status = 0, note;
+  size_t i = 0, n;
+
+  while (i < size) {
+    if (bytes[i] & 0x80) {
+      // Real time messages do not cancel the running status
+      if (bytes[i] < 0xF8) {
+        status = bytes[i] < 0xF0 ? bytes[i] : 0;
+      }
+      i++;
+    } else if (status) {
+      // Program change and channel pressure have one data byte
+      n = (status & 0xE0) == 0xC0 ? 1 : 2;
+      if (i + n > size) {
+        break;
+      }
+      if ((status & 0xE0) == MIDI_NOTEOFF) { // note on or off
+        note = bytes[i];
+        if ((status & 0xF0) == MIDI_NOTEON && bytes[i + 1]) {
+          out_notes[status & 0x0F][note / 64] |= 1ULL << note % 64;
+        } else {
+          out_notes[status & 0x0F][note / 64] &= ~(1ULL << note % 64);
+        }
+      }
+      i += n;
+    } else {
+      i++; // data of a system message
+    }
+  }
+}
+
+/* Write all the bytes put so far at once. The running status restarts
+   from each write, a receiver that missed a byte gets back in sync. */
+void ncd_output_flush() {
+  if (out_len) {
+    pthread_mutex_lock(&out_lock);
+    track_notes(out_buf, out_len);
+    ncd_out->write(out_buf, out_len);
+    pthread_mutex_unlock(&out_lock);
+    out_len = 0;
+  }
+  out_status = 0;
+}
+
+// Send a note off for each note sounding, holding out_lock
+static void notes_off() {
+  unsigned char bytes[MIDI_CHANNELS * (1 + 128 * 3)];
+  unsigned char channel, note, status = 0;
+  size_t len = 0;
+
+  for (channel = 0; channel < MIDI_CHANNELS; channel++) {
+    for (note = 0; note < 128; note++) {
+      if (out_notes[channel][note / 64] & 1ULL << note % 64) {
+        if (status != (MIDI_NOTEOFF | channel) || !ncd_output_running_status) {
+          bytes[len++] = status = MIDI_NOTEOFF | channel;
+        }
+        bytes[len++] = note;
+        bytes[len++] = 0;
+      }
+    }
+    out_notes[channel][0] = out_notes[channel][1] = 0;
+  }
+  if (len) {
+    ncd_out->write(bytes, len);
+  }
+}
+
+/* Stop exactly the notes still sounding, rather than sending all notes
+   off on every channel, which not every keyboard understands. */
+void ncd_output_notes_off() {
+  ncd_output_flush();
+  pthread_mutex_lock(&out_lock);
+  notes_off();
+  pthread_mutex_unlock(&out_lock);
+}
+
+void ncd_output_drain() {
+  ncd_output_flush();
+  pthread_mutex_lock(&out_lock);
+  ncd_out->drain();
+  pthread_mutex_unlock(&out_lock);
+}
+
+void ncd_output_close() {
+  ncd_output_drain();
+  ncd_out->close();
+}
+
+/* Silence the output for good, from any thread, e.g. on an interrupt.
+   The lock is never released: whoever tries to write after that just
+   waits for the program to exit. */
+void ncd_output_stop() {
+  pthread_mutex_lock(&out_lock);
+  notes_off();
+  ncd_out->drain();
+  ncd_out->close();
+}
@@ -0,0 +1,44 @@
+#ifndef NOCRAZYDOTS_OUTPUT_H
+#define NOCRAZYDOTS_OUTPUT_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Bytes due at the same time are sent with a single write, up to this many
+#define OUTBUFSIZE 4096
+
+/* Where MIDI bytes go. open is passed what follows the colon in the
+   -out option, or NULL. */
+typedef struct {
+  const char *name;
+  void (*open)(const char *arg);
+  void (*write)(const unsigned char *bytes, size_t size);
+  void (*drain)(); // wait for what was written to be actually sent
+  void (*close)();
+} ncd_output;
+
+extern const ncd_output ncd_output_rawmidi, ncd_output_null,
+  ncd_output_trace, ncd_output_tracebin, ncd_output_file;
+
+// The selected backend
+extern const ncd_output *ncd_out;
+
+/* Whether every write to the keyboard waits for the bytes to be sent,
+   and whether to omit repeated status bytes (MIDI running status). */
+extern bool ncd_output_sync, ncd_output_running_status;
+
+// Estimate of how long a write takes (in us), see -calibrate
+extern int64_t ncd_output_write_cost;
+
+void ncd_output_select(const char *spec);
+void ncd_output_open();
+void ncd_output_put(const unsigned char *bytes, size_t size);
+void ncd_output_flush();
+void ncd_output_discard();
+void ncd_output_notes_off();
+void ncd_output_drain();
+void ncd_output_close();
+void ncd_output_stop();
+
+#endif
@@ -24,12 +24,16 @@
 */
 #include <stdarg.h>
 #include <stdlib.h>
+#include <math.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
 #include "parser.h"
 #include "error.h"
 #include "midi.h"
 #include "queue.h"
+#include "lexer.h"
 
 #define BAR '|'
 #define BEAT ':' // optional beat separator 
@@ -53,8 +57,7 @@
 // parser and lexer are not really fully separated.
 #define NEXTC() { \
   if ((c) == '\n') ncd_parser_line_no++; \
-  (c) = getc(fp); \
-  error_if(ferror(fp)); \
+  (c) = NCD_LEX_GETC(); \
 }
 
 #define SKIPBLANKS() while (isblank(c)) NEXTC()
@@ -62,12 +65,11 @@
 // Skip note-component separator or note-span indicator at the end of note
 #define SKIPSEP() while (c == SEP) { NEXTC(); if (c == BAR || c == BEAT) NEXTC(); }
 
-// this must be called when you are sure c contains a digit
-#define READNUM(type, var) { \
-  ungetc(c, fp); \
-  fscanf(fp, "%" #type, &(var)); \
-  NEXTC(); \
-}
+// Numbers are scanned inline, the result wraps around like with scanf
+// if it does not fit into var.
+#define READNUM(var) ((var) = scan_uint())
+// Like READNUM, but accepts a minus sign and decimals too
+#define READFLOAT(var) ((var) = scan_float())
 
 // this must be called when you are sure c contains an alphanumeric
 #define READID() { \
@@ -83,47 +85,14 @@
 }
 
 #define PARSENOTE() { \
-  if (STREQ3(id, "do", "ta", "C")) { /* absolute note names */ \
-    note_no = 0; \
-    is_note = true; \
-  } else if (STREQ4(id, "di", "ra", "C#", "Db")) { \
-    note_no = 1; \
-    is_note = true; \
-  } else if (STREQ2(id, "re", "D")) { \
-    note_no = 2; \
-    is_note = true; \
-  } else if (STREQ4(id, "ri", "me", "D#", "Eb")) { \
-    note_no = 3; \
-    is_note = true; \
-  } else if (STREQ4(id, "mi", "fe", "E", "Fb")) { \
-    note_no = 4; \
-    is_note = true; \
-  } else if (STREQ4(id, "fa", "ma", "F", "E#")) { \
-    note_no = 5; \
-    is_note = true; \
-  } else if (STREQ4(id, "fi", "se", "F#", "Gb")) { \
-    note_no = 6; \
-    is_note = true; \
-  } else if (STREQ3(id, "so", "sol", "G")) { \
-    note_no = 7; \
-    is_note = true; \
-  } else if (STREQ4(id, "si", "le", "G#", "Ab")) { \
-    note_no = 8; \
-    is_note = true; \
-  } else if (STREQ2(id, "la", "A")) { \
-    note_no = 9; \
-    is_note = true; \
-  } else if (STREQ4(id, "li", "te", "A#", "Bb")) { \
-    note_no = 10; \
-    is_note = true; \
-  } else if (STREQ4(id, "ti", "de", "B", "Cb")) { \
-    note_no = 11; \
+  if ((lookup = spell_lookup(note_table, id)) >= 0) { \
+    note_no = lookup; \
     is_note = true; \
   } \
 }
 
 #define READCHANNEL(channel) { \
-  READNUM(hhu, (channel)); \
+  READNUM(channel); \
   error_check(channel > MIDI_CHANNELS, ncd_parser_line_no, \
     "Invalid channel number %hhu. There are only %u channels available", \
     (channel), MIDI_CHANNELS); \
@@ -151,6 +120,97 @@ const char *midi_note_no_name[12] = {
   "do", "di", "re", "ri", "mi", "fa", "fi", "so", "si", "la", "li", "ti"
 };
 
+/* Note names and velocity nuances are recognized through small hash
+   tables built from the spelling lists below. Spellings are case
+   insensitive and at most 4 chars long, so they are folded and packed
+   into a 32-bit key, hashed by multiplication and compared with a
+   single integer comparison. SPELLMUL has been chosen so that the
+   current spellings never collide: each lookup is one probe. New
+   spellings can simply be added to the lists, collisions are still
+   resolved by linear probing. */
+typedef struct {
+  const char *name;
+  unsigned char value;
+} ncd_spelling;
+
+static const ncd_spelling note_spellings[] = {
+  // solfege, movable do and letter names
+  {"do", 0}, {"ta", 0}, {"C", 0},
+  {"di", 1}, {"ra", 1}, {"C#", 1}, {"Db", 1},
+  {"re", 2}, {"D", 2},
+  {"ri", 3}, {"me", 3}, {"D#", 3}, {"Eb", 3},
+  {"mi", 4}, {"fe", 4}, {"E", 4}, {"Fb", 4},
+  {"fa", 5}, {"ma", 5}, {"F", 5}, {"E#", 5},
+  {"fi", 6}, {"se", 6}, {"F#", 6}, {"Gb", 6},
+  {"so", 7}, {"sol", 7}, {"G", 7},
+  {"si", 8}, {"le", 8}, {"G#", 8}, {"Ab", 8},
+  {"la", 9}, {"A", 9},
+  {"li", 10}, {"te", 10}, {"A#", 10}, {"Bb", 10},
+  {"ti", 11}, {"de", 11}, {"B", 11}, {"Cb", 11}
+};
+
+static const ncd_spelling nuance_spellings[] = {
+  {"pppp", PPPP}, {"ppp", PPP}, {"pp", PP}, {"p", P}, {"mp", MP},
+  {"mf", MF}, {"f", F}, {"ff", FF}, {"fff", FFF}, {"ffff", FFFF}
+};
+
+// Hash table size in bits, must leave room for all spellings.
+#define SPELLBITS 7
+#define SPELLSIZE (1 << SPELLBITS)
+#define SPELLMUL 0xA6CECC1Bu
+#define SPELLHASH(key) ((uint32_t)((key) * SPELLMUL) >> (32 - SPELLBITS))
+
+typedef struct {
+  uint32_t key; // 0 for an empty slot
+  unsigned char value;
+} spell_slot;
+
+static spell_slot note_table[SPELLSIZE], nuance_table[SPELLSIZE];
+
+// Pack an identifier into a key, folding case. Returns 0 if too long.
+// Setting bit 5 lowercases letters and leaves '#' unchanged.
+static uint32_t spell_key(const char *s) {
+  uint32_t key = 0;
+  register int i;
+
+  for (i = 0; s[i]; i++) {
+    if (i == 4) {
+      return 0;
+    }
+    key |= (uint32_t)(unsigned char)(s[i] | 0x20) << (8 * i);
+  }
+
+  return key;
+}
+
+static void spell_table_init(spell_slot *table, const ncd_spelling *sp,
+  int n) {
+  register uint32_t h;
+
+  memset(table, 0, SPELLSIZE * sizeof(spell_slot));
+  for (; n--; sp++) {
+    for (h = SPELLHASH(spell_key(sp->name)); table[h].key;
+         h = (h + 1) & (SPELLSIZE - 1));
+    table[h].key = spell_key(sp->name);
+    table[h].value = sp->value;
+  }
+}
+
+// Returns the value for a spelling or -1 if it is not in the table.
+static int spell_lookup(const spell_slot *table, const char *id) {
+  register uint32_t key = spell_key(id), h;
+
+  if (key) {
+    for (h = SPELLHASH(key); table[h].key; h = (h + 1) & (SPELLSIZE - 1)) {
+      if (table[h].key == key) {
+        return table[h].value;
+      }
+    }
+  }
+
+  return -1;
+}
+
 extern char *ncd_pname;
 static int c,  /* look-ahead character */
   no_notes = true; /* Is the score empty? Pessimism */
@@ -164,12 +224,46 @@ static bool tie, // whether the next note is tied to the previous
   note_stored; // is there a note stored in note?
 static ncd_event note;
 static int octave = DEFOCTAVE; // current octave
-static float duration = DEFDURATION; // current duration
+static ncd_ticks duration = DEFDURATION * NCD_WHOLE; // current duration
 signed char semitones; // distance between two notes in a slide
 
 int ncd_parser_line_no;
 
-void parse_directives(FILE *fp) {
+// Read an unsigned decimal number, c must contain a digit (blanks are skipped).
+static unsigned long scan_uint() {
+  unsigned long n = 0;
+
+  SKIPBLANKS();
+  error_check(!isdigit(c), ncd_parser_line_no, "Expected a number, found `%c'", c);
+  do {
+    n = n * 10 + (c - '0');
+    NEXTC();
+  } while (isdigit(c));
+
+  return n;
+}
+
+// Read an optionally signed decimal number with optional decimals.
+static float scan_float() {
+  bool negative;
+  float n, scale;
+
+  if ((negative = (c == '-'))) {
+    NEXTC();
+  }
+  n = scan_uint();
+  if (c == DOT) {
+    NEXTC();
+    for (scale = 0.1; isdigit(c); scale /= 10) {
+      n += (c - '0') * scale;
+      NEXTC();
+    }
+  }
+
+  return negative ? -n : n;
+}
+
+void parse_directives() {
   register unsigned int i;
   unsigned char volume, bpm, section, repeats;
   bool quote;
@@ -195,7 +289,8 @@ void parse_directives(FILE *fp) {
     id[i+1] = '\0';
 
     if (STREQ(id, "bpm")) {
-      READNUM(hhu, bpm);
+      READNUM(bpm);
+      error_check(bpm == 0, ncd_parser_line_no, "Tempo must be at least 1 bpm");
       ncd_midi_set_tempo(bpm);
     } else if (STREQ2(id, "r", "rec") || STREQ2(id, "s", "stop")
         || STREQ2(id, "p", "play")) { // pattern recording and playback
@@ -203,7 +298,7 @@ void parse_directives(FILE *fp) {
         SKIPBLANKS();
         error_check(!isdigit(c), ncd_parser_line_no,
           "Section recording directive needs a section number, found `%c'", c);
-        READNUM(hhu, section);
+        READNUM(section);
         // section numbers start at 1, but internally are 0-based
         --section;
         switch (id[0]) {
@@ -221,7 +316,7 @@ void parse_directives(FILE *fp) {
               ADVANCE();
             }
             if (isdigit(c)) {
-              READNUM(hhu, repeats);
+              READNUM(repeats);
             } else {
               repeats = 1;
             }
@@ -246,7 +341,7 @@ void parse_directives(FILE *fp) {
       SKIPBLANKS();
       error_check(!isdigit(c), ncd_parser_line_no,
         "Volume must follow channel number for voice %s, found `%c'", id, c);
-      READNUM(hhu, volume);
+      READNUM(volume);
       ncd_midi_set_voice(id, channel, volume, true);
     }
     SKIPBLANKS();
@@ -257,7 +352,7 @@ void parse_directives(FILE *fp) {
   NEXTC();
 }
 
-void parse_note(FILE *fp) {
+void parse_note() {
   unsigned char note_no, midi_note;
   bool is_note, // is it a note or a rest?
     // whether a number or numerator has been read at the beginning of a note/rest token
@@ -271,8 +366,9 @@ void parse_note(FILE *fp) {
     denom, // denominator of a duration fraction
     dots_power; // power of two to compute dotted notes duration
   char drum_id[MAXIDLEN + 2];
-  float num;
+  float num = 0;
   register int i;
+  int lookup; // spelling table lookup result
 
   // Read a number and/or (following) id in advance.
   
@@ -280,7 +376,7 @@ void parse_note(FILE *fp) {
     num_read = true;
     /* we still do not know, whether it is an octave number of a note
      or duration or numerator of a duration fraction of a rest */
-    READNUM(f, num);
+    READFLOAT(num);
     if ((number_separated = (c == SEP))) {
       SKIPSEP();
     }
@@ -320,7 +416,7 @@ void parse_note(FILE *fp) {
           ADVANCE();
 
           if (isdigit(c)) {
-            READNUM(hhd, semitones);
+            READNUM(semitones);
           } else if (isalpha(c)) {
             READID();
             semitones = note_no;
@@ -372,14 +468,14 @@ void parse_note(FILE *fp) {
   
   if (!num_read && isdigit(c)) {
     num_read = true;
-    READNUM(f, num);
+    READFLOAT(num);
   }
   
   if (c == '/') { // duration fraction
     NEXTC();
     
     if (isdigit(c)) {
-      READNUM(u, denom);
+      READNUM(denom);
     } else {
       denom = 1;
     }
@@ -388,7 +484,8 @@ void parse_note(FILE *fp) {
       num = 1;
     }
   
-    duration = num / denom;
+    error_check(denom == 0, ncd_parser_line_no, "Zero duration denominator");
+    duration = lroundf(num * NCD_WHOLE / denom);
     
     if (c == DOT) {
       // https://en.wikipedia.org/wiki/Dotted_note
@@ -397,15 +494,18 @@ void parse_note(FILE *fp) {
         dots_power *= 2; 
         NEXTC();
       } while (c == DOT);
-      duration *= 2 - 1.0 / dots_power;
+      // duration *= 2 - 1 / dots_power, rounded to the nearest tick
+      duration = (duration * (2 * dots_power - 1) + dots_power / 2) / dots_power;
     }
+    error_check(duration <= 0, ncd_parser_line_no,
+      "Duration must be at least 1/%d of a whole note", NCD_WHOLE);
   
     SKIPSEP();        
   }
   
   if (is_note) { // rests do not have velocity
     if (isdigit(c)) {
-      READNUM(hhu, velocity); // numeric velocity spec
+      READNUM(velocity); // numeric velocity spec
     } else {
       if (!id_read && (c == 'm' || c == 'f' || c == 'p')) {
         id[i = 0] = c;
@@ -419,30 +519,9 @@ void parse_note(FILE *fp) {
       }
   
       if (id_read) {
-        if (STREQ(id, "pppp")) {
-          velocity = PPPP;
-        } else if (STREQ(id, "ppp")) {
-          velocity = PPP;
-        } else if (STREQ(id, "pp")) {
-          velocity = PP;            
-        } else if (STREQ(id, "p")) {
-          velocity = P;            
-        } else if (STREQ(id, "mp")) {
-          velocity = MP;            
-        } else if (STREQ(id, "mf")) {
-          velocity = MF;            
-        } else if (STREQ(id, "f")) {
-          velocity = F;            
-        } else if (STREQ(id, "ff")) {
-          velocity = FF;            
-        } else if (STREQ(id, "fff")) {
-          velocity = FFF;            
-        } else if (STREQ(id, "ffff")) {
-          velocity = FFFF;            
-        } else {
-          trigger_error(ncd_parser_line_no,
-            "Unknown velocity nuance %s", id);
-        }
+        error_check((lookup = spell_lookup(nuance_table, id)) < 0,
+          ncd_parser_line_no, "Unknown velocity nuance %s", id);
+        velocity = lookup;
       }
     }
   }
@@ -484,7 +563,7 @@ void parse_note(FILE *fp) {
   }
 }
 
-void parse_score_row(FILE *fp) {
+void parse_score_row() {
   unsigned char percent;
   bool hairpin_type;
 
@@ -495,17 +574,19 @@ void parse_score_row(FILE *fp) {
   error_check(c == BAR, ncd_parser_line_no, "Expected one-character tag, found a bar");
   tag = c;
 
+  // read all notes and rests on this line
+  new_line();
+  note_stored = false;
+
   ADVANCE();
   if (c == BAR) {
+    ncd_queue_bar(0);
     ADVANCE();
   }
   
   error_check(c == '\n', ncd_parser_line_no,
     "Empty score line, it needs at least one note or rest");
 
-  // read all notes and rests on this line
-  new_line();
-  note_stored = false;
   do {
     if ((tie = (c == TIE))) {
       ADVANCE();
@@ -513,7 +594,7 @@ void parse_score_row(FILE *fp) {
 
     if ((hairpin_type = (c == CRESCENDO)) || c == DIMINUENDO) {
       NEXTC();
-      READNUM(hhu, percent);
+      READNUM(percent);
       error_check(percent > 127, ncd_parser_line_no,
         "Hairpin percentage must be lower than 127");
 
@@ -522,11 +603,15 @@ void parse_score_row(FILE *fp) {
       NEXTC();
       ncd_stop_hairpin(channel, note.duration);
     } else {
-      parse_note(fp);
+      parse_note();
     }
 
     SKIPBLANKS();
-    if (c == BAR || c == BEAT) {
+    if (c == BAR) {
+      // The last note read ends at the bar line, even if not pushed yet
+      ncd_queue_bar(note_stored ? note.duration : 0);
+      ADVANCE();
+    } else if (c == BEAT) {
       ADVANCE();
     }    
   } while (c != '\n');
@@ -540,6 +625,12 @@ void parse_score_row(FILE *fp) {
 void ncd_parse(FILE *fp) {
   ncd_parser_line_no = 1; // Lines are numbered starting from 1
 
+  spell_table_init(note_table, note_spellings,
+    sizeof(note_spellings) / sizeof(*note_spellings));
+  spell_table_init(nuance_table, nuance_spellings,
+    sizeof(nuance_spellings) / sizeof(*nuance_spellings));
+
+  ncd_lex_open(fp);
   NEXTC(); // prime the pump by reading the first character
   while (c != EOF) {
     SKIPBLANKS();
@@ -563,12 +654,13 @@ void ncd_parse(FILE *fp) {
     ADVANCE(); // skip BAR and blanks
 
     if (isalpha(c) || c == QUOTE) {
-      parse_directives(fp);
+      parse_directives();
       continue;
     }
     
-    parse_score_row(fp);
+    parse_score_row();
   }
+  ncd_lex_close();
   if (no_notes) {
     trigger_error(ncd_parser_line_no, "empty score, no notes found");
   }
@@ -0,0 +1,572 @@
+/*
+   NoCrazyDots
+   Machine and human readable polyphonic music notation
+   without crazy dots.
+   Supports automated playing and auto-accompainment.
+
+   (c) 2017-2019 Antonio Bonifati aka Farmboy
+   <http://farmboymusicblog.wordpress.com>
+
+   This file is part of NoCrazyDots.
+
+   NoCrazyDots is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   NoCrazyDots is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with NoCrazyDots.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Play the score timeline, alone or along with a human player.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "error.h"
+#include "midi.h"
+#include "parser.h"
+#include "queue.h"
+#include "timeline.h"
+#include "player.h"
+#include "timer.h"
+#include "sender.h"
+#include "stats.h"
+#include "rt.h"
+#include "input.h"
+
+// Default max random error percentage. E.g 5 for 5%
+// (to better simulate human playing)
+#define DEFRAND 0
+
+// Default number of steps of the human's part to look ahead for the notes
+#define DEFWINDOW 3
+
+unsigned char ncd_percent_randomness = DEFRAND;
+uint64_t ncd_random_seed;
+
+// Number of transposition semitones
+signed char ncd_trans_semitones = 0;
+
+unsigned ncd_from_bar = 0, ncd_to_bar = 0;
+
+unsigned ncd_follow_window = DEFWINDOW;
+
+// Part of the timeline to play, when it starts and when it stops
+static ncd_tl_event *play_start, *play_end;
+static int64_t play_origin, play_stop;
+// Time of the bar line playing starts from, -1 from the beginning
+static ncd_ticks play_from;
+
+/* What a channel would be like at play_start, had the score been played
+   from the beginning. -1 for what was never set. */
+typedef struct {
+  short bank_msb, bank_lsb, program, volume, expression, expression_fine,
+    pitch_wheel;
+  unsigned char velocity[128]; // of the notes sounding, 0 if not sounding
+} chase_state;
+
+static chase_state chase_states[MIDI_CHANNELS];
+
+// Find the part of the timeline to play through the bar index
+static void seek() {
+  play_start = ncd_timeline;
+  play_end = ncd_timeline + ncd_timeline_len;
+  play_origin = 0;
+  play_from = -1;
+
+  if (ncd_from_bar) {
+    error_check(ncd_from_bar > ncd_bars_len
+      || ncd_bars[ncd_from_bar - 1].pos == ncd_timeline_len, 0,
+      "There is no such bar to play from");
+    play_start = ncd_timeline + ncd_bars[ncd_from_bar - 1].pos;
+    play_from = ncd_bars[ncd_from_bar - 1].time;
+    play_origin = ncd_tempo_us(play_from);
+  }
+  if (ncd_to_bar) {
+    error_check(ncd_to_bar > ncd_bars_len, 0,
+      "There is no such bar to play to");
+    error_check(ncd_to_bar < ncd_from_bar, 0,
+      "The bar to play to comes before the one to play from");
+    if (ncd_to_bar < ncd_bars_len) {
+      play_end = ncd_timeline + ncd_bars[ncd_to_bar].pos;
+      play_stop = ncd_tempo_us(ncd_bars[ncd_to_bar].time);
+    }
+  }
+}
+
+static bool is_note_off(ncd_tl_event *ev) {
+  return ev->size && ((ev->msg[MIDI_STATUS] & 0xF0) == MIDI_NOTEOFF
+    || ((ev->msg[MIDI_STATUS] & 0xF0) == MIDI_NOTEON && ev->msg[MIDI_DATA2] == 0));
+}
+
+/* Whether a record is already taken into account by chase: the note offs
+   on the bar line playing starts from, of notes that were never struck */
+static bool chased(ncd_tl_event *ev) {
+  return ev->time == play_from && is_note_off(ev);
+}
+
+static void chase_event(ncd_tl_event *ev) {
+  chase_state *st = &chase_states[ev->channel];
+  unsigned char *msg = ev->msg;
+
+  switch (msg[MIDI_STATUS] & 0xF0) {
+    case MIDI_NOTEON:
+      st->velocity[msg[MIDI_DATA1]] = msg[MIDI_DATA2];
+      break;
+    case MIDI_NOTEOFF:
+      st->velocity[msg[MIDI_DATA1]] = 0;
+      break;
+    case MIDI_PROGRAM_CHANGE:
+      st->program = msg[MIDI_DATA1];
+      break;
+    case MIDI_PITCH_WHEEL:
+      st->pitch_wheel = msg[MIDI_DATA1] | msg[MIDI_DATA2] << 7;
+      break;
+    case MIDI_CONTROLLER:
+      if (msg[MIDI_DATA1] == MIDI_SNDBANK_MSB) {
+        st->bank_msb = msg[MIDI_DATA2];
+      } else if (msg[MIDI_DATA1] == MIDI_SNDBANK_LSB) {
+        st->bank_lsb = msg[MIDI_DATA2];
+      } else if (msg[MIDI_DATA1] == MIDI_VOLUME) {
+        st->volume = msg[MIDI_DATA2];
+      } else if (msg[MIDI_DATA1] == MIDI_EXPRESSION_MSB) {
+        st->expression = msg[MIDI_DATA2];
+      } else if (msg[MIDI_DATA1] == MIDI_EXPRESSION_LSB) {
+        st->expression_fine = msg[MIDI_DATA2];
+      }
+      break;
+  }
+}
+
+static void chase_send(ncd_render_send send, unsigned char status,
+  unsigned char data1, unsigned char data2, unsigned char size) {
+  ncd_midi_event msg = {status, data1, data2};
+
+  send(msg, size);
+}
+
+/* Bring the channels in the state they would be at play_start, notes
+   sounding included, without going through what comes before. */
+static void chase(ncd_render_send send) {
+  ncd_tl_event *ev, *end = ncd_timeline + ncd_timeline_len;
+  chase_state *st;
+  unsigned char channel;
+  int note;
+
+  if (play_start == ncd_timeline) {
+    return;
+  }
+
+  for (channel = 0; channel < MIDI_CHANNELS; channel++) {
+    st = &chase_states[channel];
+    st->bank_msb = st->bank_lsb = st->program = st->volume = st->expression
+      = st->expression_fine = st->pitch_wheel = -1;
+    memset(st->velocity, 0, sizeof(st->velocity));
+  }
+  for (ev = ncd_timeline; ev < play_start; ev++) {
+    if (ev->size) {
+      chase_event(ev);
+    }
+  }
+  /* Notes ending right on the bar line are not sounding anymore. Those
+     tied over it are, even if nothing starts there. */
+  for (; ev < end && ev->time == play_from; ev++) {
+    if (is_note_off(ev)) {
+      chase_event(ev);
+    }
+  }
+
+  for (channel = 0; channel < MIDI_CHANNELS; channel++) {
+    st = &chase_states[channel];
+    if (st->bank_msb >= 0) {
+      chase_send(send, MIDI_CONTROLLER | channel, MIDI_SNDBANK_MSB, st->bank_msb, 3);
+    }
+    if (st->bank_lsb >= 0) {
+      chase_send(send, MIDI_CONTROLLER | channel, MIDI_SNDBANK_LSB, st->bank_lsb, 3);
+    }
+    if (st->program >= 0) {
+      chase_send(send, MIDI_PROGRAM_CHANGE | channel, st->program, 0, 2);
+    }
+    if (st->volume >= 0) {
+      chase_send(send, MIDI_CONTROLLER | channel, MIDI_VOLUME, st->volume, 3);
+    }
+    if (st->expression >= 0) {
+      chase_send(send, MIDI_CONTROLLER | channel, MIDI_EXPRESSION_MSB,
+        st->expression, 3);
+    }
+    if (st->expression_fine >= 0) {
+      chase_send(send, MIDI_CONTROLLER | channel, MIDI_EXPRESSION_LSB,
+        st->expression_fine, 3);
+    }
+    if (st->pitch_wheel >= 0) {
+      chase_send(send, MIDI_PITCH_WHEEL | channel, st->pitch_wheel & 0x7F,
+        st->pitch_wheel >> 7, 3);
+    }
+    for (note = 0; note < 128; note++) {
+      if (st->velocity[note]) {
+        chase_send(send, MIDI_NOTEON | channel, note, st->velocity[note], 3);
+      }
+    }
+  }
+}
+
+/* Release the notes ending at the bar line where playing stops. Those
+   tied over it are left to ncd_output_notes_off. */
+static void stop(ncd_render_send send) {
+  ncd_tl_event *ev, *end = ncd_timeline + ncd_timeline_len;
+
+  for (ev = play_end; ev < end && ev->time == play_end->time; ev++) {
+    if (is_note_off(ev)) {
+      send(ev->msg, ev->size);
+    }
+  }
+}
+
+/* Send the timeline, where hairpins and slides are already expanded and
+   velocities randomized, from -from to -to. wait is called with each
+   deadline in turn, from the start of playing, send with every message
+   to send. */
+void ncd_render(ncd_render_wait wait, ncd_render_send send) {
+  ncd_tl_event *ev;
+  int64_t due = INT64_MIN;
+
+  seek();
+  if (play_start > ncd_timeline) {
+    wait(due = 0);
+    chase(send);
+  }
+
+  for (ev = play_start; ev < play_end; ev++) {
+    if (ev->us - play_origin != due) {
+      wait(due = ev->us - play_origin);
+    }
+
+    if (ev->size && !chased(ev)) {
+      send(ev->msg, ev->size);
+    }
+  }
+
+  if (play_end < ncd_timeline + ncd_timeline_len) {
+    wait(play_stop - play_origin);
+    stop(send);
+  }
+}
+
+// The preparation side: turn the timeline into packets for the sender
+static void play_wait(int64_t us) {
+  ncd_sender_wait(us);
+}
+
+static void play_send(ncd_midi_event msg, unsigned char size) {
+  #ifdef DEBUG
+  NCD_MIDI_PRINT(msg);
+  #endif
+  ncd_sender_send(msg, size);
+}
+
+void ncd_play() {
+  error_check(ncd_timeline_len == 0, 0, "Playing empty score");
+  seek(); // again in ncd_render, but better fail before starting
+  // At most one write per message
+  ncd_stats_init(ncd_timeline_len);
+  ncd_rt_prepare();
+  ncd_sender_start();
+  ncd_render(play_wait, play_send);
+  ncd_sender_finish();
+  ncd_output_notes_off();
+  ncd_output_drain();
+}
+
+/* A step of the auto-accompaniment: the records due at the same score
+   time, and the notes the human is expected to play then, one bit per
+   key for note ons and for note offs. Built once, so that the timeline
+   is left as it is and matching a note takes constant time. */
+typedef struct acc_step {
+  ncd_tl_event *start, *end;
+  uint64_t expected[2][128 / 64]; // [0] for note ons, [1] for note offs
+  // The next step where the human starts notes, NULL if none
+  struct acc_step *next;
+} acc_step;
+
+#define NOTEMASK(note) (1ULL << (note) % 64)
+
+static acc_step *acc_steps;
+static size_t acc_steps_len;
+
+// Split the part to play into steps, with the notes tagged with tag
+static void build_steps(char tag) {
+  ncd_tl_event *ev;
+  acc_step *st, *next;
+  int note;
+
+  acc_steps_len = 0;
+  for (ev = play_start; ev < play_end; ev++) {
+    if (ev == play_start || ev->time != ev[-1].time) {
+      acc_steps_len++;
+    }
+  }
+  error_if((acc_steps = calloc(acc_steps_len, sizeof(acc_step))) == NULL);
+
+  st = acc_steps - 1;
+  for (ev = play_start; ev < play_end; ev++) {
+    if (ev == play_start || ev->time != ev[-1].time) {
+      (++st)->start = ev;
+    }
+    st->end = ev + 1;
+
+    if (ev->tag == tag) {
+      // Records are transposed, the notes played by the human are not
+      note = ev->msg[MIDI_DATA1];
+      if (ev->channel != DRUMCHANNEL) {
+        note -= ncd_trans_semitones;
+      }
+      if (note >= 0 && note < 128) {
+        st->expected[is_note_off(ev)][note / 64] |= NOTEMASK(note);
+      }
+    }
+  }
+
+  next = NULL;
+  for (st = acc_steps + acc_steps_len - 1; st >= acc_steps; st--) {
+    st->next = next;
+    if (st->expected[0][0] || st->expected[0][1]) {
+      next = st;
+    }
+  }
+}
+
+// Keys the human is holding down, after the notes taken from the input
+static uint64_t acc_held[128 / 64];
+
+static void hold(ncd_midi_event msg) {
+  unsigned char note = msg[MIDI_DATA1];
+
+  if ((msg[MIDI_STATUS] & 0xF0) == MIDI_NOTEON) {
+    acc_held[note / 64] |= NOTEMASK(note);
+  } else {
+    acc_held[note / 64] &= ~NOTEMASK(note);
+  }
+}
+
+/* What the human has to play for a step to be done. Keys already
+   released, or never pressed, are not waited for to be released. */
+static void expect(acc_step *st, uint64_t pending[2][128 / 64]) {
+  int i;
+
+  for (i = 0; i < 128 / 64; i++) {
+    pending[0][i] = st->expected[0][i];
+    pending[1][i] = st->expected[1][i] & acc_held[i];
+  }
+}
+
+static bool waiting(uint64_t pending[2][128 / 64]) {
+  return pending[0][0] || pending[0][1] || pending[1][0] || pending[1][1];
+}
+
+static int count_notes(uint64_t notes[128 / 64]) {
+  return __builtin_popcountll(notes[0]) + __builtin_popcountll(notes[1]);
+}
+
+// Take a note played by the human out of those still pending, if there
+static bool match_note(uint64_t pending[2][128 / 64], ncd_midi_event msg) {
+  // The input turns note ons with velocity 0 into note offs
+  int off = (msg[MIDI_STATUS] & 0xF0) == MIDI_NOTEOFF;
+  unsigned char note = msg[MIDI_DATA1];
+
+  if (!(pending[off][note / 64] & NOTEMASK(note))) {
+    return false;
+  }
+  pending[off][note / 64] &= ~NOTEMASK(note);
+  return true;
+}
+
+/* Find where the human went on to, when they start a note that is not
+   in the step being waited for: the first of the next ncd_follow_window
+   steps where they should start it, NULL if none. Takes no longer than
+   the window, whatever is in between. */
+static acc_step *look_ahead(acc_step *st, ncd_midi_event msg) {
+  unsigned char note = msg[MIDI_DATA1];
+  unsigned i;
+
+  if ((msg[MIDI_STATUS] & 0xF0) != MIDI_NOTEON) {
+    return NULL;
+  }
+  for (i = 0, st = st->next; st && i < ncd_follow_window;
+      i++, st = st->next) {
+    if (st->expected[0][note / 64] & NOTEMASK(note)) {
+      return st;
+    }
+  }
+  return NULL;
+}
+
+/* Put the records of a step, but those played by the human, and tell
+   the channels they are on. A step skipped by the human is played
+   without its note ons, so that the band does not play them all at
+   once and keeps the controllers right. */
+static unsigned short stage(acc_step *st, char tag, bool skipped) {
+  ncd_tl_event *ev;
+  unsigned short channels = 0;
+
+  for (ev = st->start; ev < st->end; ev++) {
+    if (ev->size && ev->tag != tag && !chased(ev) && !(skipped
+        && (ev->msg[MIDI_STATUS] & 0xF0) == MIDI_NOTEON && !is_note_off(ev))) {
+      NCD_MIDI_WRITE(ev->msg, ev->size);
+      channels |= 1 << ev->channel;
+    }
+  }
+  return channels;
+}
+
+static void auto_send(ncd_midi_event msg, unsigned char size) {
+  NCD_MIDI_WRITE(msg, size);
+}
+
+/* Tempo following. How fast the human plays is the ratio between the
+   time they took from a step to the next and the time the score gives,
+   smoothed so that the band does not jerk at every uneven note. Ratios
+   out of range are pauses or mistakes rather than tempo, so they are
+   left out. The steps the band plays alone are stretched by it from
+   the last step the human played. */
+#define FOLLOWRATE 4 // each new ratio moves the speed by 1/FOLLOWRATE
+#define FOLLOWMIN 0.5
+#define FOLLOWMAX 2.0
+
+static double follow_speed; // the human's time per score time
+// The last step the human started notes on, -1 if none yet
+static int64_t follow_us, follow_clock;
+// Where the timer was last synchronized with the human
+static int64_t follow_sync;
+
+static void follow(acc_step *st, int64_t clock) {
+  int64_t us = st->start->us;
+  double ratio;
+
+  // Releases are too loose to tell the tempo, only the attacks count
+  if (st->expected[0][0] || st->expected[0][1]) {
+    if (follow_us >= 0 && us > follow_us) {
+      ratio = (double) (clock - follow_clock) / (us - follow_us);
+      if (ratio >= FOLLOWMIN && ratio <= FOLLOWMAX) {
+        follow_speed += (ratio - follow_speed) / FOLLOWRATE;
+      }
+    }
+    follow_us = us;
+    follow_clock = clock;
+  }
+
+  ncd_timer_sync_at(us, clock);
+  follow_sync = us;
+}
+
+// When the band should play alone what the score puts at us, in timer time
+static int64_t follow_due(int64_t us) {
+  return follow_sync + (int64_t) ((us - follow_sync) * follow_speed);
+}
+
+/* The human player will play notes tagged with tag. Wrong notes are
+   ignored, and missed ones too as soon as the human plays a note ahead. */
+void ncd_auto_accompaniment(char tag) {
+  acc_step *st, *ahead;
+  ncd_input_event note;
+  uint64_t pending[2][128 / 64];
+  unsigned short channels;
+  int64_t due;
+  int missed = 0, wrong = 0;
+
+  error_check(ncd_timeline_len == 0, 0, "Playing empty score");
+  seek();
+  build_steps(tag);
+  ncd_stats_init(acc_steps_len);
+  ncd_rt_prepare();
+  ncd_rt_pin(pthread_self(), ncd_sender_cpu);
+  ncd_rt_report(pthread_self());
+  chase(auto_send);
+  ncd_output_flush();
+  ncd_input_open();
+  ncd_timer_sync(play_origin);
+  follow_speed = 1;
+  follow_us = -1;
+  follow_sync = play_origin;
+  memset(acc_held, 0, sizeof(acc_held));
+  for (st = acc_steps; st < acc_steps + acc_steps_len; st++) {
+    /* Get the answer to the human ready while waiting, so that it only
+       takes one write to send it. */
+    channels = stage(st, tag, false);
+    expect(st, pending);
+
+    #ifdef DEBUG
+    printf("%d events to wait\n", count_notes(pending[0])
+      + count_notes(pending[1]));
+    #endif
+
+    if (!waiting(pending)) {
+      due = follow_due(st->start->us);
+      ncd_timer_sleep_until(due);
+    } else {
+      while (waiting(pending)) {
+        ncd_input_wait_note(&note);
+        hold(note.msg);
+        if (match_note(pending, note.msg)) {
+          #ifdef DEBUG
+          printf("matched %02hhx %hhu%s %02hhx\n", note.msg[MIDI_STATUS],
+            MIDI_OCTAVE(note.msg[MIDI_DATA1]),
+            midi_note_no_name[MIDI_NOTE_NO(note.msg[MIDI_DATA1])],
+            note.msg[MIDI_DATA2]);
+          #endif
+        } else if ((ahead = look_ahead(st, note.msg))) {
+          // Catch up with the human, leaving out what they missed
+          ncd_output_discard();
+          missed += count_notes(pending[0]);
+          channels = stage(st, tag, true);
+          while (++st < ahead) {
+            missed += count_notes(st->expected[0]);
+            channels |= stage(st, tag, true);
+          }
+          channels |= stage(st, tag, false);
+          expect(st, pending);
+          match_note(pending, note.msg);
+          #ifdef DEBUG
+          printf("skipped to %.3f\n", (double) st->start->time / NCD_WHOLE);
+          #endif
+        } else if ((note.msg[MIDI_STATUS] & 0xF0) == MIDI_NOTEON) {
+          wrong++;
+          #ifdef DEBUG
+          printf(" unmatched\n");
+          #endif
+        }
+      }
+
+      // Keep time from when the human played the last note of the step
+      follow(st, note.clock);
+      due = st->start->us;
+      #ifdef DEBUG
+      printf("speed %.3f\n", follow_speed);
+      #endif
+    }
+
+    if (channels) {
+      ncd_output_flush();
+      // How late after its time, or after the human's note, it was sent
+      NCD_STATS_RECORD(due, ncd_timer_now() - due, channels);
+    }
+  }
+
+  if (play_end < ncd_timeline + ncd_timeline_len) {
+    ncd_timer_sleep_until(follow_due(play_stop));
+    stop(auto_send);
+  }
+  ncd_output_notes_off();
+  ncd_output_drain();
+  free(acc_steps);
+
+  if (missed || wrong) {
+    printf("%d notes missed, %d wrong notes\n", missed, wrong);
+  }
+}
@@ -0,0 +1,29 @@
+#ifndef NOCRAZYDOTS_PLAYER_H
+#define NOCRAZYDOTS_PLAYER_H
+
+#include <stdint.h>
+#include "midi.h"
+
+// Percent to randomize velocities in order to avoid to sound too mechanical
+extern unsigned char ncd_percent_randomness;
+// Seed of the random numbers, the same seed gives the same velocities
+extern uint64_t ncd_random_seed;
+
+extern signed char ncd_trans_semitones;
+
+// Bars to play from and to, both included. 0 for the first and last one
+extern unsigned ncd_from_bar, ncd_to_bar;
+
+/* How many steps of the human's part to look ahead for a note that is
+   not the one expected, before taking it for a wrong note */
+extern unsigned ncd_follow_window;
+
+// Callbacks of ncd_render and of the automation, see player.c
+typedef void (*ncd_render_wait)(int64_t us);
+typedef void (*ncd_render_send)(ncd_midi_event msg, unsigned char size);
+
+void ncd_render(ncd_render_wait wait, ncd_render_send send);
+void ncd_play();
+void ncd_auto_accompaniment(char tag);
+
+#endif
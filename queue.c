@@ -27,38 +27,28 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <stdbool.h>
 #include "error.h"
 #include "queue.h"
 #include "midi.h"
 #include "parser.h"
-#include "timer.h"
+#include "arena.h"
 
 #define min(a, b) (((a) < (b)) ? (a) : (b))
 
-// Default number of beats per minute. Each beat is a quarter note.
-#define DEFBPM 60
-
-// Define duration of the pitch wheel ascending slope
-#define PITCH_WHEEL_DUR 150000 // in us
-
-// Each expression volume increment/decrement or pitch wheel change
-// will be done in this time interval (in us). Must be a fraction
-// of PITCH_WHEEL_DUR
-#define EXPR_STEP 1500 // e.g. 100000 us = 0.1s
-
 static struct {
   ncd_node *start;
   ncd_node *end;
-  float start_time;
+  ncd_ticks start_time;
   // Rest bright at the end of the recording.
-  float end_rest;
+  ncd_ticks end_rest;
 } section[MAXSEC];
 
 // Lookup table to implement volume dynamics.
 typedef struct {
-  float start_time;
+  ncd_ticks start_time;
   /* Since the event array may get reallocated, we cannot simple store
      a pointer to an element of that array as in
 
@@ -72,55 +62,44 @@ typedef struct {
 
 static ncd_hairpin_table hairpin[MIDI_CHANNELS];
 
-// Convertion factor from BPM to ms
-#define BPM2US(bpm) (2.4E8 / (bpm)) // 2.4E8 = 1000000 ms * 60s / (1/4)
-// Default max random error percentage. E.g 5 for 5%
-// (to better simulate human playing)
-#define DEFRAND 0
-
-unsigned char bpm = DEFBPM,
-  ncd_percent_randomness = DEFRAND;
-
-// Number of transposition semitones
-signed char ncd_trans_semitones = 0;
-
-// returns a random number x +- ncd_percent_randomness%
-#define RANDOMIZE(x)  ((x)-((x)*ncd_percent_randomness/100) \
-  + rand() % (int)((x)*ncd_percent_randomness/50 + 1))
- 
 typedef struct {
   ncd_node *start; // score start (overall queue begin)
   ncd_node *tail; // last element of the queue
 
-  ncd_node *head; // begin of the queue (current line)
+  /* Time-bucketed index over the linked nodes, so that the node for a
+     given time can be found without walking the list: before[k] is the
+     last node starting before k * INDEXSTEP ticks (NULL if none).
+     It covers all buckets up to the one of the tail node. */
+  ncd_node **before;
+  size_t index_len, index_size;
+
+  size_t events_len; // total number of events in all the nodes
 } ncd_queue;
 
 // Note queue to represent the score in memory.
 static ncd_queue queue;
 
-static float
+static ncd_ticks
   start_group_time = 0,
   current_time = 0; // this serves as a priority value
 
-int first_group = 1;
+/* Times of the bar lines found in score rows, sorted and without
+   repetitions, since the rows of a group usually share them. */
+static ncd_ticks *bars;
+static size_t bars_len, bars_size;
+
+/* Width of an index bucket. A lookup walks at most the nodes starting
+   within one bucket, a sixteenth note rarely holds more than a few. */
+#define INDEXSTEP (NCD_PPQ / 4)
 
 // As a rule of thumb this should not be lower of the number of notes
 // your keyboard can play at once, but also accounts for other meta-events.  
 #define MAXEVENTS 64
-// How many events to preallocate per node, min 1, max MAXPOLIPHONY
-#define INITEVENTNO 3
-// Smallest measure subdivision (relative to measure)
-// https://en.wikipedia.org/wiki/Two_hundred_fifty-sixth_note
-#define SMALLESTDUR 1.0/256
 
-#define EQUALTIMES(a, b) (fabsf((a) - (b)) < SMALLESTDUR)
+ncd_arena ncd_score_arena;
  
 void new_group() {
   start_group_time = current_time;
-  queue.head = queue.tail;
-  if (queue.head) {
-    first_group = 0;
-  }
 }
 
 void new_line() {
@@ -128,24 +107,36 @@ void new_line() {
 }
 
 void add_note(ncd_node *node, ncd_event note) {
+  ncd_event *events;
+  unsigned char size;
+
   if (node->events_len >= node->events_size) {
-    node->events_size *= 2;
-    if (node->events_size > MAXEVENTS) {
-      node->events_size = MAXEVENTS;
+    /* Move to a bigger array. The old one is released with the arena.
+       This also copies events shared with a recorded section
+       (events_size 0) before writing to them. */
+    if (node->events_len < NODEEVENTS) { // only a shared array is this small
+      events = node->inline_events;
+      size = NODEEVENTS;
+    } else {
+      error_check(node->events_len >= MAXEVENTS, 0,
+        "Reached MAXEVENTS (%d)", MAXEVENTS);
+      size = min(node->events_len * 2, MAXEVENTS);
+      events = ncd_arena_alloc(&ncd_score_arena, size * sizeof(ncd_event));
     }
-    error_check(node->events_len >= node->events_size, 0,
-      "Reached MAXEVENTS (%d)", MAXEVENTS);
-    node->events = realloc(node->events, node->events_size * sizeof(ncd_event));
+    memcpy(events, node->events, node->events_len * sizeof(ncd_event));
+    node->events = events;
+    node->events_size = size;
   }
   
   node->events[node->events_len++] = note;
+  queue.events_len++;
 }
 
-ncd_node *new_node(float start_time) {
-  ncd_node *node;
-  error_if((node = malloc(sizeof(ncd_node))) == NULL);
-  error_if((node->events = malloc(INITEVENTNO * sizeof(ncd_event))) == NULL);
-  node->events_size = INITEVENTNO;
+ncd_node *new_node(ncd_ticks start_time) {
+  ncd_node *node = ncd_arena_alloc(&ncd_score_arena, sizeof(ncd_node));
+
+  node->events = node->inline_events;
+  node->events_size = NODEEVENTS;
   node->events_len = 0;
   node->start_time = start_time;
   node->next = NULL;
@@ -153,87 +144,132 @@ ncd_node *new_node(float start_time) {
   return node;
 }
 
-ncd_node *dup_node(ncd_node *node, float start_time) {
-  ncd_node *copy;
-  error_if((copy = malloc(sizeof(ncd_node))) == NULL);
+ncd_node *dup_node(ncd_node *node, ncd_ticks start_time) {
+  ncd_node *copy = ncd_arena_alloc(&ncd_score_arena, sizeof(ncd_node));
+
   copy->events = node->events; // share events to save memory
-  copy->events_size = node->events_size;
+  copy->events_size = 0; // copy on write, see add_note
   copy->events_len = node->events_len;
+  queue.events_len += copy->events_len;
   copy->start_time = start_time;
   copy->next = NULL;
 
   return copy;
 }
 
-// Insertion sort on a queue starting from a specific point
+// Return the last node starting before time t, NULL if there is none.
+static ncd_node *node_before(ncd_ticks t) {
+  register ncd_node *prev, *curr;
+  size_t bucket = t / INDEXSTEP;
+
+  if (bucket >= queue.index_len) {
+    return queue.tail; // past the tail bucket, so later than any node
+  }
+  prev = queue.before[bucket];
+  for (curr = prev ? prev->next : queue.start;
+       curr && curr->start_time < t; prev = curr, curr = curr->next);
+
+  return prev;
+}
+
+// Link node into the queue after prev (at the front if prev is NULL)
+// and keep the index up to date.
+static void link_node(ncd_node *prev, ncd_node *node) {
+  size_t bucket = node->start_time / INDEXSTEP + 1;
+
+  if (prev) {
+    node->next = prev->next;
+    prev->next = node;
+  } else {
+    node->next = queue.start;
+    queue.start = node;
+  }
+
+  if (node->next) {
+    // node is now the last one before the buckets up to its successor
+    for (; bucket * INDEXSTEP <= node->next->start_time; bucket++) {
+      queue.before[bucket] = node;
+    }
+  } else {
+    // new tail, extend the index up to its bucket
+    if (bucket > queue.index_size) {
+      queue.index_size = bucket * 2;
+      error_if((queue.before = realloc(queue.before,
+        queue.index_size * sizeof(ncd_node *))) == NULL);
+    }
+    while (queue.index_len < bucket) {
+      queue.before[queue.index_len++] = prev;
+    }
+    queue.tail = node;
+  }
+}
+
+// Sorted insertion, the node for a given time is found through the index.
 // Returns a pointer to the event for possible later reference.
 ncd_ev_ref ncd_queue_push_event(ncd_event note) {
   ncd_ev_ref ret;
-  ncd_node *curr, *prev, *new;
+  ncd_node *prev, *curr;
   unsigned char status = note.msg[MIDI_STATUS] & 0xF0;
   bool meta_event = (status == MIDI_CONTROLLER && note.msg[MIDI_DATA1] == MIDI_EXPRESSION_MSB)
     || status == MIDI_PITCH_WHEEL;
-  float start_time = (status == MIDI_NOTEOFF) ?
+  ncd_ticks start_time = (status == MIDI_NOTEOFF) ?
     current_time + note.duration : current_time;
 
-  for (curr = queue.head, prev = NULL; curr;
-       prev = curr, curr = curr->next) {
-    if (EQUALTIMES(curr->start_time, start_time)) {
-      add_note(curr, note);
-      if (!meta_event) {
-        current_time += note.duration;
-      }
-      ret.node = curr;
-      ret.event_no = curr->events_len - 1;
-      return ret;
-    } else if (curr->start_time > start_time) {
-      break;
-    }
-  }
-
-  /* head and tail insertion */
-  new = new_node(start_time);
-  add_note(new, note);
-  new->next = curr;
-  if (curr == NULL) {
-    queue.tail = new;
-  }
-  if (prev != NULL) {
-    prev->next = new;
+  prev = node_before(start_time);
+  curr = prev ? prev->next : queue.start;
+  if (curr && curr->start_time == start_time) {
+    add_note(curr, note);
   } else {
-    queue.head = new;
-    if (first_group) {
-      queue.start = queue.head;
-    }
+    curr = new_node(start_time);
+    add_note(curr, note);
+    link_node(prev, curr);
   }
 
   if (!meta_event) {
     current_time += note.duration;
   }
 
-  ret.node = new;
-  ret.event_no = 0;
+  ret.node = curr;
+  ret.event_no = curr->events_len - 1;
   return ret;
 }
 
-void ncd_queue_push_rest(float duration) {
+void ncd_queue_push_rest(ncd_ticks duration) {
   // not queued, it just increments current time
   current_time += duration;
 }
 
+// Consume the queue from its start. No more events can be pushed
+// afterwards, since the index is not updated.
 ncd_node *ncd_queue_pop_node() {
   ncd_node *ret = queue.start;
   if (queue.start) {
     queue.start = (queue.start)->next;
+    queue.events_len -= ret->events_len;
   } else {
     queue.tail = NULL;
   }
   return ret;
 }
 
-void ncd_free_node(ncd_node *node) {
-  free(node->events);
-  free(node);
+// Release all the memory held by the score at once
+void ncd_queue_free() {
+  ncd_arena_free(&ncd_score_arena);
+  free(queue.before);
+  memset(&queue, 0, sizeof(queue));
+  free(bars);
+  bars = NULL;
+  bars_len = bars_size = 0;
+  memset(section, 0, sizeof(section));
+  memset(hairpin, 0, sizeof(hairpin));
+  start_group_time = current_time = 0;
+}
+
+// Display times as fractions of a whole note
+#define TICKS2WHOLE(t) ((float)(t) / NCD_WHOLE)
+
+size_t ncd_queue_events_len() {
+  return queue.events_len;
 }
 
 // Useful for debugging
@@ -254,22 +290,23 @@ void ncd_queue_display() {
                   && note.msg[MIDI_DATA1] == MIDI_EXPRESSION_MSB) {
         printf("\t%s\t%.3f\t\t%hhu\t\t\t%hhu%%\t\t%.3f\t%p\n",
           note.msg[MIDI_DATA2] & 0x80 ? "cresc" : "decresc",
-          node->start_time, channel + 1, note.msg[MIDI_DATA2] & 0x7F,
-          note.duration, &(node->events[i]));
+          TICKS2WHOLE(node->start_time), channel + 1,
+          note.msg[MIDI_DATA2] & 0x7F, TICKS2WHOLE(note.duration),
+          &(node->events[i]));
       } else {
         type = note.msg[MIDI_STATUS] & 0xF0;
         if (type == MIDI_NOTEON || type == MIDI_NOTEOFF) {
           if (channel != DRUMCHANNEL) {
             printf("%c\t%02x\t%.3f\t\t%hhu\t%hhu (%hhu%s)\t%hhu\t\t%.3f\n",
-              note.tag, type, node->start_time, channel + 1,
+              note.tag, type, TICKS2WHOLE(node->start_time), channel + 1,
               note.msg[MIDI_DATA1], MIDI_OCTAVE(note.msg[MIDI_DATA1]),
               midi_note_no_name[MIDI_NOTE_NO(note.msg[MIDI_DATA1])],
-              note.msg[MIDI_DATA2], note.duration);
+              note.msg[MIDI_DATA2], TICKS2WHOLE(note.duration));
           } else {
             printf("%c\t%02x\t%.3f\t\t%hhu\t%hhu (%-3s)\t%hhu\t\t%.3f\n",
-              note.tag, type, node->start_time, channel + 1,
+              note.tag, type, TICKS2WHOLE(node->start_time), channel + 1,
               note.msg[MIDI_DATA1], midi_drum_name[note.msg[MIDI_DATA1]],
-              note.msg[MIDI_DATA2], note.duration);
+              note.msg[MIDI_DATA2], TICKS2WHOLE(note.duration));
           }
         }
         // TODO
@@ -281,289 +318,46 @@ void ncd_queue_display() {
   }
 }
 
-void ncd_play() {
-  ncd_node *node;
-  ncd_midi_event msg;
-  float prev_start_time = 0, conv_unit = BPM2US(DEFBPM),
-    final_volume, volume_delta, curr_volume, internote_delay,
-    new_curr_value; // for both volume and pitch wheel value
-  unsigned char status, channel, i;
-  signed char semitones; // for sliding
-  
-  STOPWATCH_START();
-  error_check(queue.start == NULL, 0, "Playing empty score");
-  for (node = queue.start; node; node = node->next) {
-    internote_delay = (node->start_time - prev_start_time) * conv_unit;
- 
-    while (internote_delay >= EXPR_STEP) {
-      CHRONOSLEEP(EXPR_STEP);
-      internote_delay -= EXPR_STEP;
-
-      for (channel = 0; channel < MIDI_CHANNELS; channel++) {
-        if (ncd_expression[channel].left_duration) {
-          new_curr_value = ncd_expression[channel].current + ncd_expression[channel].volume_step;
-          if (new_curr_value > 127 || new_curr_value < 0) {
-            // no use to keep increasing/decreasing volume on this channel
-            ncd_expression[channel].left_duration = 0;
-            continue;
-          }
+// Add a bar line at time t, unless there is already one
+static void add_bar(ncd_ticks t) {
+  size_t lo = 0, hi = bars_len, mid;
 
-          if ((ncd_expression[channel].left_duration -= EXPR_STEP / conv_unit) < 0) {
-            ncd_expression[channel].left_duration = 0;
-          }
-
-          // Spare bandwidth... only send a volume change message
-          // if the new volume is actually different than the current one
-          if ((int)new_curr_value != (int)ncd_expression[channel].current) {
-            ncd_midi_set_volume((unsigned char)new_curr_value, channel);
-          }
-          ncd_expression[channel].current = new_curr_value;
-        }
-
-        // Pitch wheel manipulation for sliding is akin to volume
-        // change for expression
-        if (ncd_pitch_wheel[channel].left_duration) {
-          new_curr_value = ncd_pitch_wheel[channel].current
-            + ncd_pitch_wheel[channel].value_step;
-
-          if (new_curr_value > 0x3FFF || new_curr_value < 0) {
-            // no use to keep increasing/decreasing pitch on this channel
-            ncd_pitch_wheel[channel].left_duration = 0;
-            continue;
-          }
-
-          if ((ncd_expression[channel].left_duration -= EXPR_STEP / conv_unit) < 0) {
-            ncd_expression[channel].left_duration = 0;
-          }
-
-          // Spare bandwidth... only send a pitch wheel change message
-          // if the new pitch is actually different than the current one
-          if ((int)new_curr_value != (int)ncd_pitch_wheel[channel].current) {
-            ncd_midi_pitch_wheel((unsigned short)new_curr_value, channel);
-          }
-          ncd_pitch_wheel[channel].current = new_curr_value;
-        }
+  // Rows are parsed in time order, so most bar lines go at the end
+  if (bars_len == 0 || bars[bars_len - 1] < t) {
+    lo = bars_len;
+  } else {
+    while (lo < hi) {
+      mid = (lo + hi) / 2;
+      if (bars[mid] < t) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
       }
     }
-    CHRONOSLEEP(internote_delay);
-
-    // Reset pitch wheel to center position at the end of bent note
-    // for all channels.
-    for (channel = 0; channel < MIDI_CHANNELS; channel++) {
-      // Spare bandwidth... only send a pitch wheel change message
-      // if the pitch wheel is not already centered
-      if (ncd_pitch_wheel[channel].current != NOBENDING) {
-        ncd_pitch_wheel[channel].current = NOBENDING;
-        ncd_midi_pitch_wheel(NOBENDING, channel);
-      }
+    if (bars[lo] == t) {
+      return;
     }
+  }
 
-    for (i = 0; i < node->events_len; i++) {
-      memcpy(msg, node->events[i].msg, sizeof(ncd_midi_event));
-      status = msg[MIDI_STATUS] & 0xF0;
-      channel = msg[MIDI_STATUS] & 0x0F;
-
-      // Warning: non standard but works
-      if (msg[MIDI_STATUS] == MIDI_META && msg[MIDI_DATA1] == MIDI_SET_TEMPO) {
-        conv_unit = BPM2US(msg[MIDI_DATA2]);
-      } else if (status == MIDI_CONTROLLER
-             && msg[MIDI_DATA1] == MIDI_EXPRESSION_MSB) {
-          curr_volume = ncd_expression[channel].current;
-          if ((msg[MIDI_DATA2] & 0x80)) { // crescendo
-            final_volume = ncd_expression[channel].reference
-              * (100.0 + (msg[MIDI_DATA2] & 0x7F)) / 100;
-          } else { // decrescendo
-            final_volume = ncd_expression[channel].reference
-              * (100.0 - (msg[MIDI_DATA2] & 0x7F)) / 100;
-          }
-
-          // Volume limiter
-          if (final_volume > 127) {
-            final_volume = 127;
-            warning(ncd_parser_line_no,
-              "warning: expression hairpin on channel %hhu increased volume to a value >127."
-              " Clipped to 127.\nConsider user a smaller percentage.\n",
-              channel + 1);
-          } else if (final_volume < 0) {
-            final_volume = 0;              
-            warning(ncd_parser_line_no,
-              "warning: expression hairpin on channel %hhu decreased volume to a value <0."
-              " Clipped to 0.\nConsider user a smaller percentage.\n",
-              channel + 1);
-          }
-
-          volume_delta = final_volume - curr_volume;
-          if ((msg[MIDI_DATA2] & 0x80)) {
-            if (volume_delta < 0) {
-              warning(ncd_parser_line_no,
-                "warning: current volume is greater than final crescendo volume. Did you mean a decrescendo?");
-            }
-          } else if (volume_delta > 0) {
-            warning(ncd_parser_line_no,
-              "warning: current volume is less than final decrescendo volume. Did you mean a crescendo?");
-          }
-
-          /* From proportion:
-
-                 volume_delta           volume_step
-            ------------------------ = -------------
-              duration * conv_unit      EXPR_STEP
-          */
-          ncd_expression[channel].volume_step = EXPR_STEP * volume_delta
-            / ( (ncd_expression[channel].left_duration = node->events[i].duration)
-                * conv_unit );
-          if (fabsf(ncd_expression[channel].volume_step) > fabsf(volume_delta)) {
-            ncd_expression[channel].volume_step = volume_delta;
-            warning(ncd_parser_line_no,
-              "warning: expression hairpin does not apply: duration too short\n");
-          }
-      } else if (status == MIDI_PITCH_WHEEL) {
-        // TODO: this code assumes the pitch wheel range is only a tone.
-        // see "Errata" at http://midi.teragonaudio.com/tech/midispec/wheel.htm
-
-        semitones = ncd_pitch_wheel[channel].semitones = msg[MIDI_DATA1];
-        if (abs(semitones) > 2) {
-          warning(ncd_parser_line_no,
-            "warning: sliding more than one tone is currently not supported");
-          semitones = semitones > 0 ? 2 : -2;
-        }
-
-        ncd_pitch_wheel[channel].current = NOBENDING;
-
-	/* Change pitch linearly for
-             slope_duration = min(PITCH_WHEEL_DUR,node->events[i].duration)
-	   us and if time is left (note is longer than that), keep it
-	   constant. The descending slope due to the pitch wheel
-	   spring is not implemented. This it is usually faster than a
-           single EXPR_STEP.
-
-           From proportion:
-
-            semitones * 0x1000           value_step
-          --------------------------- = ------------
-           slope_duration * conv_unit     EXPR_STEP
-        */
-        ncd_pitch_wheel[channel].value_step = EXPR_STEP * semitones * 0x1000
-          / ( (ncd_pitch_wheel[channel].left_duration =
-                 min(PITCH_WHEEL_DUR / conv_unit, node->events[i].duration))
-              * conv_unit );
-      } else {
-	if (status == MIDI_NOTEON) {
-          msg[MIDI_DATA2] = RANDOMIZE(msg[MIDI_DATA2]);
-        }
-        if (channel != DRUMCHANNEL
-             && (status == MIDI_NOTEON  || status == MIDI_NOTEOFF)) {
-          msg[MIDI_DATA1] += ncd_trans_semitones;
-        }
-        NCD_MIDI_EVENT(msg);
-      }
-    }
-    prev_start_time = node->start_time;
+  if (bars_len == bars_size) {
+    bars_size = bars_size ? 2 * bars_size : 64;
+    error_if((bars = realloc(bars, bars_size * sizeof(ncd_ticks))) == NULL);
   }
+  memmove(bars + lo + 1, bars + lo, (bars_len - lo) * sizeof(ncd_ticks));
+  bars[lo] = t;
+  bars_len++;
 }
 
-// the human player will play notes tagged with tag
-// Note: it does support neither dynamics (crescendo/diminuendo) nor slides
-void ncd_auto_accompaniment(char tag) {
-  ncd_node *node;
-  ncd_midi_event *note;
-  register ncd_event *event;
-  register ncd_midi_event *msg;
-  int i, ev_to_wait;
-  float prev_start_time = 0, duration,
-    conv_unit = BPM2US(DEFBPM);
-  unsigned char status, channel;
-
-  error_check(queue.start == NULL, 0, "Playing empty score");
-  STOPWATCH_RESET();
-  for (node = queue.start; node; node = node->next) {
-    // count the number of events that should be played by the human
-    ev_to_wait = 0;
-    for (i = 0; i < node->events_len; i++) {
-      if (node->events[i].tag == tag) {
-        ev_to_wait++;
-      }
-    }
-
-    #ifdef DEBUG
-    printf("%d events to wait\n", ev_to_wait);
-    #endif
-
-    if (ev_to_wait == 0) {
-      if ((duration = node->start_time - prev_start_time)) {
-        STOPWATCH_STOP();
-        usleep(duration * conv_unit - STOPWATCH_READ());
-      }
-    } else {
-      // wait until all events happened and take them out of the event list
-      #ifdef DEBUG
-      next:
-      #endif
-      while (ev_to_wait) {
-        note = ncd_midi_wait_note();
-
-        // find event in list
-        for (i = 0; i < node->events_len; i++) {
-          event = &(node->events[i]);
-          if (event->tag == tag) {
-            msg = &(event->msg);
-          
-            if (ncd_midi_same_event(*msg, *note)) {
-              #ifdef DEBUG
-              printf("matched %02hhx %hhu%s %02hhx\n", (*msg)[MIDI_STATUS],
-                MIDI_OCTAVE((*msg)[MIDI_DATA1]), midi_note_no_name[MIDI_NOTE_NO((*msg)[MIDI_DATA1])],
-                (*msg)[MIDI_DATA2]);
-              #endif
-
-              ev_to_wait--;
-              // remove node->events[i] from array
-              node->events_len--;
-              while (i < node->events_len) {
-                 node->events[i] = node->events[i+1];
-                 i++;
-              }
-              #ifdef DEBUG
-              goto next;
-              #endif
-              break;
-            }
-          }
-        }
-        #ifdef DEBUG
-        printf(" unmatched\n");
-        #endif
-      }
-    }
-
-    STOPWATCH_START();
-
-    #ifdef DEBUG
-    printf("%d events to send\n", node->events_len);
-    #endif
-
-    // play the remaining event list
-    for (i = 0; i < node->events_len; i++) {
-      event = &(node->events[i]);
-      msg = &(event->msg);
-      // Warning: non standard but works
-      if ((*msg)[MIDI_STATUS] == MIDI_META && (*msg)[MIDI_DATA1] == MIDI_SET_TEMPO) {
-        conv_unit = BPM2US((*msg)[MIDI_DATA2]);
-      } else if (((*msg)[MIDI_STATUS] & 0xF0) != MIDI_CONTROLLER) {
-        status = (*msg)[MIDI_STATUS] & 0xF0;
-        channel = (*msg)[MIDI_STATUS] & 0x0F;
-		if (status == MIDI_NOTEON) {
-          (*msg)[MIDI_DATA2] = RANDOMIZE((*msg)[MIDI_DATA2]);
-        }
-        if (channel != DRUMCHANNEL
-             && (status == MIDI_NOTEON  || status == MIDI_NOTEOFF)) {
-          (*msg)[MIDI_DATA1] += ncd_trans_semitones;
-	    }
-        NCD_MIDI_EVENT(*msg);
-      }
-    }
+// A bar line in a score row, pending ticks after the current time since
+// the last note read may not be pushed yet
+void ncd_queue_bar(ncd_ticks pending) {
+  add_bar(current_time + pending);
+}
 
-    prev_start_time = node->start_time;
-  }
+// The bar lines found so far, sorted by time
+ncd_ticks *ncd_queue_bars(size_t *len) {
+  *len = bars_len;
+  return bars;
 }
 
 void ncd_section_rec(unsigned char sec_no) {
@@ -591,18 +385,33 @@ void ncd_section_stop(unsigned char sec_no) {
 
 void ncd_section_play(unsigned char sec_no) {
   ncd_node *p;
-  float prev_start_time = section[sec_no].start_time;
+  ncd_ticks prev_start_time = section[sec_no].start_time, end_time, *copy;
   unsigned char i;
   register ncd_event *event;
+  size_t first, last, bar;
 
   error_check((p = section[sec_no].start) == NULL, ncd_parser_line_no,
     "Trying to playing section no %hhu not previously recorded",
     sec_no + 1);
 
+  /* The bar lines are played again too. Copied first, adding them may
+     move the ones of the section. */
+  end_time = section[sec_no].end->start_time + section[sec_no].end_rest;
+  for (first = 0; first < bars_len && bars[first] < prev_start_time; first++);
+  for (last = first; last < bars_len && bars[last] <= end_time; last++);
+  if (last > first) {
+    error_if((copy = malloc((last - first) * sizeof(ncd_ticks))) == NULL);
+    memcpy(copy, bars + first, (last - first) * sizeof(ncd_ticks));
+    for (bar = 0; bar < last - first; bar++) {
+      add_bar(copy[bar] - prev_start_time + current_time);
+    }
+    free(copy);
+  }
+
   // append a copy of the section to the MIDI-event queue.
   do {
 	current_time += p->start_time - prev_start_time;
-	if (EQUALTIMES(current_time, queue.tail->start_time)) {
+	if (current_time == queue.tail->start_time) {
 	  // leave off all note off events in the first node of the section
 	  // since they belong to notes coming right before the section
 	  for (i = 0; i < p->events_len; i++) {
@@ -612,8 +421,7 @@ void ncd_section_play(unsigned char sec_no) {
 	    }
 	  }
     } else if (p == section[sec_no].end) {
-      queue.tail->next = new_node(current_time);
-      queue.tail = queue.tail->next;
+      link_node(queue.tail, new_node(current_time));
       // leave off all note on events in the last node of the section
       // since they belong to notes coming right after the section
       for (i = 0; i < p->events_len; i++) {
@@ -628,8 +436,7 @@ void ncd_section_play(unsigned char sec_no) {
 
 	  break;
     } else {
-      queue.tail->next = dup_node(p, current_time);
-      queue.tail = queue.tail->next;
+      link_node(queue.tail, dup_node(p, current_time));
     }
     
     prev_start_time = p->start_time;
@@ -638,7 +445,7 @@ void ncd_section_play(unsigned char sec_no) {
 }
 
 void ncd_start_hairpin(bool crescendo, unsigned char percent,
-  unsigned char channel, float last_note_dur) {
+  unsigned char channel, ncd_ticks last_note_dur) {
   ncd_event ev;
   ncd_hairpin_table *hp = &(hairpin[channel]);
 
@@ -659,7 +466,7 @@ void ncd_start_hairpin(bool crescendo, unsigned char percent,
   hp->start_time = current_time + last_note_dur;
 }
 
-void ncd_stop_hairpin(unsigned char channel, float last_note_dur) {
+void ncd_stop_hairpin(unsigned char channel, ncd_ticks last_note_dur) {
   ncd_hairpin_table *hp = &(hairpin[channel]);
   
   error_check(hp->ev_ref.node == NULL, ncd_parser_line_no, "No hairping to close");
@@ -671,7 +478,8 @@ void ncd_stop_hairpin(unsigned char channel, float last_note_dur) {
   hp->ev_ref.node = NULL; // There is no more a hairpin to end.
 }
 
-void ncd_slide(signed char semitones, unsigned char channel, float next_note_dur) {
+void ncd_slide(signed char semitones, unsigned char channel,
+  ncd_ticks next_note_dur) {
   ncd_event ev;
   
   // Queue up a MIDI pitch wheel event (non-standard but it works):
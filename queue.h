@@ -2,6 +2,7 @@
 #define NOCRAZYDOTS_QUEUE_H
 
 #include "midi.h"
+#include "arena.h"
 
 // Maximum number of sections that can be recorded
 #define MAXSEC 128
@@ -9,44 +10,60 @@
 // Pitch wheel center value
 #define NOBENDING 0x2000
 
-// Percent to randomize velocities in order to avoid to sound too mechanical
-extern unsigned char ncd_percent_randomness;
-
-extern signed char ncd_trans_semitones;
+/* Score time is measured in integer ticks, so that event times can be
+   compared exactly and never pile up rounding errors. NCD_PPQ ticks make
+   a quarter note: 960 divides evenly by 2, 3 and 5, so triplets,
+   quintuplets and notes down to 1/256 of a whole are exact, dotted ones
+   down to 1/128. It is also a valid Standard MIDI File division. */
+#define NCD_PPQ 960
+#define NCD_WHOLE (4 * NCD_PPQ) // ticks in a whole note
+typedef long ncd_ticks;
 
 typedef struct {
   ncd_midi_event msg;
   char tag; // ' ' (space) for note-unrelated events
-  float duration; // 0 for note-unrelated events
+  ncd_ticks duration; // 0 for note-unrelated events
 } ncd_event;
 
+// Events stored in the node itself, most nodes do not need more
+#define NODEEVENTS 4
+
 typedef struct ncd_node { // Struct name needed for defining the next field
-  ncd_event *events;
+  ncd_event *events; // inline_events or a bigger array
   unsigned char events_size;
   unsigned char events_len;
-  float start_time;
+  ncd_ticks start_time;
   struct ncd_node *next;
+  ncd_event inline_events[NODEEVENTS];
 } ncd_node;
 
+/* Memory for what lives as long as the score: the queue nodes and their
+   event arrays, then the timeline, tempo map and bar index built from
+   them */
+extern ncd_arena ncd_score_arena;
+
 typedef struct {
   ncd_node* node; // initialized to a NULL pointer
   unsigned char event_no; // zero based array index
 } ncd_ev_ref;
 
 ncd_ev_ref ncd_queue_push_event(ncd_event event);
-void ncd_queue_push_rest(float duration);
+void ncd_queue_push_rest(ncd_ticks duration);
 ncd_node* ncd_queue_pop_node();
+size_t ncd_queue_events_len();
+void ncd_queue_free();
+void ncd_queue_bar(ncd_ticks pending);
+ncd_ticks *ncd_queue_bars(size_t *len);
 void ncd_queue_display();
 void new_line();
 void new_group();
-void ncd_play();
-void ncd_auto_accompaniment(char tag);
 void ncd_section_rec(unsigned char sec_no);
 void ncd_section_stop(unsigned char sec_no);
 void ncd_section_play(unsigned char sec_no);
 void ncd_start_hairpin(bool crescendo, unsigned char percent,
-  unsigned char channel, float last_note_dur);
-void ncd_stop_hairpin(unsigned char channel, float last_note_dur);
-void ncd_slide(signed char semitones, unsigned char channel, float next_note_dur);
+  unsigned char channel, ncd_ticks last_note_dur);
+void ncd_stop_hairpin(unsigned char channel, ncd_ticks last_note_dur);
+void ncd_slide(signed char semitones, unsigned char channel,
+  ncd_ticks next_note_dur);
 
 #endif
@@ -0,0 +1,136 @@
+/*
+   NoCrazyDots
+   Machine and human readable polyphonic music notation
+   without crazy dots.
+   Supports automated playing and auto-accompainment.
+
+   (c) 2017-2019 Antonio Bonifati aka Farmboy
+   <http://farmboymusicblog.wordpress.com>
+
+   This file is part of NoCrazyDots.
+
+   NoCrazyDots is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   NoCrazyDots is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with NoCrazyDots.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Real-time preparation: everything that can make the player miss a
+   deadline for reasons other than its own work is done once, before
+   the first note. That is page faults, timer slack and the scheduler
+   moving it to another CPU or running something else instead. */
+
+#define _GNU_SOURCE // for pthread_setaffinity_np and the CPU_* macros
+#include <stdio.h>
+#include <stdbool.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include "error.h"
+#include "timeline.h"
+#include "sender.h"
+#include "rt.h"
+
+static bool rt_locked, rt_slack;
+
+void ncd_rt_prepare() {
+  struct sched_param sp;
+
+  // Below the thread actually sending the notes
+  sp.sched_priority = SENDERPRIO - 1;
+  if (sched_setscheduler(0, SCHED_FIFO, &sp) == -1) {
+    warning(0, "warning: cannot gain realtime privileges. See README.md");
+  }
+
+  // Inherited by the threads created from now on
+  rt_slack = prctl(PR_SET_TIMERSLACK, RTSLACK) == 0;
+
+  rt_locked = mlockall(MCL_CURRENT | MCL_FUTURE) == 0;
+  if (!rt_locked) {
+    warning(0, "warning: cannot lock memory, notes may be late on page faults. See README.md");
+  }
+
+  // Locking already brings in the pages, but not the stack still to grow
+  ncd_rt_prefault(ncd_timeline, ncd_timeline_len * sizeof(ncd_tl_event));
+  ncd_rt_prefault_stack();
+}
+
+// Read a byte of each page, for them to be there when needed
+void ncd_rt_prefault(const void *mem, size_t size) {
+  const volatile unsigned char *p = mem;
+  long page = sysconf(_SC_PAGESIZE);
+  size_t i;
+
+  for (i = 0; i < size; i += page) {
+    p[i];
+  }
+}
+
+void ncd_rt_prefault_stack() {
+  unsigned char stack[RTSTACK];
+  volatile unsigned char *p = stack;
+  long page = sysconf(_SC_PAGESIZE);
+  size_t i;
+
+  for (i = 0; i < RTSTACK; i += page) {
+    p[i] = 0;
+  }
+}
+
+// Keep thread on cpu, -1 for the last one, away from everything else
+void ncd_rt_pin(pthread_t thread, int cpu) {
+  cpu_set_t cpus;
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  error_check(cpu >= ncpus, 0, "No such CPU, see -cpu");
+  if (ncpus < 2) {
+    return;
+  }
+  if (cpu < 0) {
+    cpu = ncpus - 1;
+  }
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  if (pthread_setaffinity_np(thread, sizeof(cpus), &cpus) != 0) {
+    warning(0, "warning: cannot pin the player to CPU %d", cpu);
+  }
+}
+
+// Tell what the player actually got, as asking is not always enough
+void ncd_rt_report(pthread_t player) {
+  struct sched_param sp;
+  cpu_set_t cpus;
+  int policy, cpu, pinned = -1;
+
+  printf("Real-time: ");
+  if (pthread_getschedparam(player, &policy, &sp) == 0
+      && policy == SCHED_FIFO) {
+    printf("priority %d", sp.sched_priority);
+  } else {
+    printf("no priority");
+  }
+  if (pthread_getaffinity_np(player, sizeof(cpus), &cpus) == 0
+      && CPU_COUNT(&cpus) == 1) {
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &cpus)) {
+        pinned = cpu;
+      }
+    }
+  }
+  if (pinned >= 0) {
+    printf(", CPU %d", pinned);
+  } else {
+    printf(", any CPU");
+  }
+  printf(", memory %s, timer slack %s\n", rt_locked ? "locked" : "not locked",
+    rt_slack ? "minimal" : "default");
+}
@@ -0,0 +1,19 @@
+#ifndef NOCRAZYDOTS_RT_H
+#define NOCRAZYDOTS_RT_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+// Bytes of stack touched beforehand, more than the player ever needs
+#define RTSTACK (64 * 1024)
+
+// Timer slack in ns, 0 would mean the default one (usually 50us)
+#define RTSLACK 1
+
+void ncd_rt_prepare();
+void ncd_rt_prefault(const void *mem, size_t size);
+void ncd_rt_prefault_stack();
+void ncd_rt_pin(pthread_t thread, int cpu);
+void ncd_rt_report(pthread_t player);
+
+#endif
@@ -0,0 +1,185 @@
+/*
+   NoCrazyDots
+   Machine and human readable polyphonic music notation
+   without crazy dots.
+   Supports automated playing and auto-accompainment.
+
+   (c) 2017-2019 Antonio Bonifati aka Farmboy
+   <http://farmboymusicblog.wordpress.com>
+
+   This file is part of NoCrazyDots.
+
+   NoCrazyDots is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   NoCrazyDots is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with NoCrazyDots.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* A thread doing nothing but sending MIDI bytes at their deadlines, fed
+   through a lock-free single-producer/single-consumer ring. Whatever
+   the preparation does, e.g. computing or page faulting, cannot delay
+   a note unless it gets RINGSIZE packets behind. */
+
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include "error.h"
+#include "output.h"
+#include "timer.h"
+#include "stats.h"
+#include "rt.h"
+#include "sender.h"
+
+// How long a side waits for the other when the ring is full or empty
+#define RINGWAIT 200000 // in ns
+
+typedef struct {
+  int64_t us; // deadline
+  unsigned short channels; // bit mask, for the statistics
+  unsigned char len;
+  unsigned char bytes[PACKETSIZE];
+} ncd_packet;
+
+int ncd_sender_cpu = -1;
+
+static ncd_packet ring[RINGSIZE];
+// Written by the preparation only and by the sender only respectively
+static atomic_size_t ring_head, ring_tail;
+static atomic_bool ring_done;
+
+// Packet being filled by the preparation, not in the ring yet
+static ncd_packet packet;
+
+static pthread_t sender_thread;
+
+static void ring_pause() {
+  struct timespec ts = {0, RINGWAIT};
+
+  nanosleep(&ts, NULL);
+}
+
+static void *sender_loop(void *arg) {
+  size_t tail = 0;
+  ncd_packet *p;
+  int64_t start, end;
+
+  ncd_rt_prefault_stack();
+  // Let the preparation get ahead before the clock starts
+  while (atomic_load_explicit(&ring_head, memory_order_acquire) < RINGSIZE
+      && !atomic_load_explicit(&ring_done, memory_order_acquire)) {
+    ring_pause();
+  }
+
+  ncd_timer_start();
+  while (1) {
+    if (tail == atomic_load_explicit(&ring_head, memory_order_acquire)) {
+      if (atomic_load_explicit(&ring_done, memory_order_acquire)
+          && tail == atomic_load_explicit(&ring_head, memory_order_acquire)) {
+        break;
+      }
+      ring_pause(); // underrun, the preparation is late
+      continue;
+    }
+
+    p = &ring[tail % RINGSIZE];
+    // Start writing early enough for the write to be over at the deadline
+    start = p->us - ncd_output_write_cost;
+    start += ncd_timer_sleep_until(start);
+    ncd_output_put(p->bytes, p->len);
+    ncd_output_flush();
+    end = ncd_timer_now();
+    ncd_timer_adapt(&ncd_output_write_cost, end - start);
+    NCD_STATS_RECORD(p->us, end - p->us, p->channels);
+    atomic_store_explicit(&ring_tail, ++tail, memory_order_release);
+  }
+
+  return NULL;
+}
+
+// Give the packet being filled to the sender
+static void ring_push() {
+  size_t head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+
+  if (packet.len == 0) {
+    return;
+  }
+
+  while (head - atomic_load_explicit(&ring_tail, memory_order_acquire)
+      == RINGSIZE) {
+    ring_pause();
+  }
+  ring[head % RINGSIZE] = packet;
+  atomic_store_explicit(&ring_head, head + 1, memory_order_release);
+  packet.len = 0;
+  packet.channels = 0;
+}
+
+void ncd_sender_start() {
+  pthread_attr_t attr;
+  struct sched_param sp;
+
+  // In case memory could not be locked
+  memset(ring, 0, sizeof(ring));
+  atomic_store(&ring_head, 0);
+  atomic_store(&ring_tail, 0);
+  atomic_store(&ring_done, false);
+  packet.us = 0;
+  packet.len = 0;
+  packet.channels = 0;
+
+  error_if(pthread_attr_init(&attr) != 0);
+  pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+  pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+  sp.sched_priority = SENDERPRIO;
+  pthread_attr_setschedparam(&attr, &sp);
+  // Locked in memory as a whole, do not take the default megabytes
+  pthread_attr_setstacksize(&attr, SENDERSTACK);
+  if (pthread_create(&sender_thread, &attr, sender_loop, NULL) != 0) {
+    warning(0, "warning: cannot gain realtime privileges for the sender thread. See README.md");
+    error_if((errno = pthread_create(&sender_thread, NULL, sender_loop, NULL)) != 0);
+  }
+  pthread_attr_destroy(&attr);
+
+  // Keep the sender on a CPU of its own, away from the preparation
+  ncd_rt_pin(sender_thread, ncd_sender_cpu);
+  ncd_rt_report(sender_thread);
+}
+
+// What is sent from now on is due at us
+void ncd_sender_wait(int64_t us) {
+  if (us != packet.us) {
+    ring_push();
+    packet.us = us;
+  }
+}
+
+void ncd_sender_send(const unsigned char *bytes, unsigned char size) {
+  if (packet.len + size > PACKETSIZE) {
+    ring_push();
+  }
+  memcpy(packet.bytes + packet.len, bytes, size);
+  packet.len += size;
+  if (bytes[0] < 0xF0) {
+    packet.channels |= 1 << (bytes[0] & 0x0F);
+  }
+}
+
+// Wait for the sender to send everything
+void ncd_sender_finish() {
+  ring_push();
+  atomic_store_explicit(&ring_done, true, memory_order_release);
+  error_if((errno = pthread_join(sender_thread, NULL)) != 0);
+}
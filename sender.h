@@ -0,0 +1,26 @@
+#ifndef NOCRAZYDOTS_SENDER_H
+#define NOCRAZYDOTS_SENDER_H
+
+#include <stdint.h>
+
+// Real-time priority of the sender thread, the rest of the program runs below
+#define SENDERPRIO 98
+
+// Number of packets the preparation may be ahead of the sender (power of 2)
+#define RINGSIZE 1024
+
+// Bytes of one packet. More bytes due at once take more packets
+#define PACKETSIZE 60
+
+// Stack size of the sender thread, it needs a few KB
+#define SENDERSTACK (256 * 1024)
+
+// CPU the sender thread is pinned to (see -cpu), -1 for the last one
+extern int ncd_sender_cpu;
+
+void ncd_sender_start();
+void ncd_sender_wait(int64_t us);
+void ncd_sender_send(const unsigned char *bytes, unsigned char size);
+void ncd_sender_finish();
+
+#endif
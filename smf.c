@@ -0,0 +1,198 @@
+/*
+   NoCrazyDots
+   Machine and human readable polyphonic music notation
+   without crazy dots.
+   Supports automated playing and auto-accompainment.
+
+   (c) 2017-2019 Antonio Bonifati aka Farmboy
+   <http://farmboymusicblog.wordpress.com>
+
+   This file is part of NoCrazyDots.
+
+   NoCrazyDots is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   NoCrazyDots is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with NoCrazyDots.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Render the timeline to a Standard MIDI File, no device needed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "error.h"
+#include "midi.h"
+#include "queue.h"
+#include "timeline.h"
+#include "player.h"
+#include "smf.h"
+
+// Conductor track plus one track per channel in format 1
+#define SMF_TRACKS (MIDI_CHANNELS + 1)
+#define SMF_TRACKSIZE 4096 // initial size of a track buffer
+
+#define MIDI_END_OF_TRACK 0x2F
+
+typedef struct {
+  unsigned char *data;
+  size_t len, size;
+  ncd_ticks last; // time of the last event, for delta times
+} smf_track;
+
+unsigned char ncd_smf_format = DEFSMFFORMAT;
+
+static smf_track smf_tracks[SMF_TRACKS];
+// Time of the events being rendered
+static ncd_ticks smf_now;
+// Next segment of the tempo map to write as a tempo meta-event
+static size_t smf_tempo_next;
+
+static void track_put(smf_track *t, const unsigned char *bytes, size_t n) {
+  if (t->len + n > t->size) {
+    t->size = t->size ? 2 * t->size : SMF_TRACKSIZE;
+    error_if((t->data = realloc(t->data, t->size)) == NULL);
+  }
+  while (n--) {
+    t->data[t->len++] = *bytes++;
+  }
+}
+
+// Append an event at smf_now preceded by its variable-length delta time
+static void track_event(smf_track *t, const unsigned char *bytes, size_t n) {
+  unsigned char vlq[4];
+  unsigned long delta = smf_now - t->last;
+  int i = sizeof(vlq);
+
+  vlq[--i] = delta & 0x7F;
+  while ((delta >>= 7) && i) {
+    vlq[--i] = (delta & 0x7F) | 0x80;
+  }
+  track_put(t, vlq + i, sizeof(vlq) - i);
+  track_put(t, bytes, n);
+  t->last = smf_now;
+}
+
+static smf_track *channel_track(unsigned char channel) {
+  return &smf_tracks[ncd_smf_format ? channel + 1 : 0];
+}
+
+static void channel_event(unsigned char b0, unsigned char b1, unsigned char b2) {
+  unsigned char e[3] = {b0, b1, b2};
+
+  track_event(channel_track(b0 & 0x0F), e, sizeof(e));
+}
+
+/* The same setup ncd_midi_init sends to the keyboard, otherwise players
+   would use their own defaults. */
+static void channel_setup(unsigned char channel) {
+  unsigned char status = MIDI_CONTROLLER | channel;
+
+  channel_event(status, MIDI_VOLUME, DEFVOLUME);
+  channel_event(MIDI_PITCH_WHEEL | channel, NOBENDING & 0x7F, NOBENDING >> 7);
+  // Pitch bend sensitivity of a tone, then out of RPN mode
+  channel_event(status, 0x64, 0x00);
+  channel_event(status, 0x65, 0x00);
+  channel_event(status, 0x06, 2);
+  channel_event(status, 0x26, 0x00);
+  channel_event(status, 0x64, 0x7F);
+  channel_event(status, 0x65, 0x7F);
+}
+
+static void smf_wait(int64_t us) {
+  ncd_tempo *seg;
+  ncd_ticks time = ncd_tempo_ticks(us);
+  unsigned long us_per_beat;
+  unsigned char e[6] = {MIDI_META, MIDI_SET_TEMPO, 3};
+
+  /* A section played back while the previous notes are still going on
+     goes earlier than what came before. The player sends it as soon as
+     possible, do the same, delta times cannot be negative. */
+  if (time > smf_now) {
+    smf_now = time;
+  }
+
+  // Tempo changes go to the conductor track, which is the only one in format 0
+  for (; smf_tempo_next < ncd_tempo_map_len
+      && (seg = &ncd_tempo_map[smf_tempo_next])->time <= time;
+      smf_tempo_next++) {
+    us_per_beat = 60000000 / seg->bpm;
+    e[3] = us_per_beat >> 16;
+    e[4] = us_per_beat >> 8;
+    e[5] = us_per_beat;
+    track_event(&smf_tracks[0], e, sizeof(e));
+  }
+}
+
+static void smf_send(ncd_midi_event msg, unsigned char size) {
+  track_event(channel_track(msg[MIDI_STATUS] & 0x0F), msg, size);
+}
+
+static void put_be(FILE *fp, unsigned long n, int bytes) {
+  while (bytes--) {
+    error_if(putc((n >> (8 * bytes)) & 0xFF, fp) == EOF);
+  }
+}
+
+void ncd_smf_write(const char *filename) {
+  static const unsigned char end_of_track[] = {MIDI_META, MIDI_END_OF_TRACK, 0};
+  ncd_tl_event *ev, *end = ncd_timeline + ncd_timeline_len;
+  bool used[MIDI_CHANNELS] = {false};
+  smf_track *t;
+  unsigned char channel;
+  int ntracks;
+  FILE *fp;
+
+  error_check(ncd_timeline_len == 0, 0, "Writing empty score");
+
+  for (ev = ncd_timeline; ev < end; ev++) {
+    if (ev->kind != TL_TEMPO) {
+      used[ev->channel] = true;
+    }
+  }
+
+  smf_now = 0;
+  smf_tempo_next = 0;
+  smf_wait(0);
+  for (channel = 0; channel < MIDI_CHANNELS; channel++) {
+    if (used[channel]) {
+      channel_setup(channel);
+    }
+  }
+
+  ncd_render(smf_wait, smf_send);
+
+  for (ntracks = 0, t = smf_tracks; t < smf_tracks + SMF_TRACKS; t++) {
+    if (t == smf_tracks || t->len) {
+      smf_now = t->last;
+      track_event(t, end_of_track, sizeof(end_of_track));
+      ntracks++;
+    }
+  }
+
+  error_if((fp = fopen(filename, "wb")) == NULL);
+  fputs("MThd", fp);
+  put_be(fp, 6, 4);
+  put_be(fp, ncd_smf_format, 2);
+  put_be(fp, ntracks, 2);
+  put_be(fp, NCD_PPQ, 2);
+  for (t = smf_tracks; t < smf_tracks + SMF_TRACKS; t++) {
+    if (t->len) {
+      fputs("MTrk", fp);
+      put_be(fp, t->len, 4);
+      error_if(fwrite(t->data, 1, t->len, fp) != t->len);
+    }
+    free(t->data);
+    t->data = NULL;
+    t->len = t->size = 0;
+    t->last = 0;
+  }
+  error_if(fclose(fp) == EOF);
+}
@@ -0,0 +1,11 @@
+#ifndef NOCRAZYDOTS_SMF_H
+#define NOCRAZYDOTS_SMF_H
+
+// 0 for a single track, 1 for a tempo track plus one track per channel
+#define DEFSMFFORMAT 1
+
+extern unsigned char ncd_smf_format;
+
+void ncd_smf_write(const char *filename);
+
+#endif
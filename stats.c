@@ -0,0 +1,203 @@
+/*
+   NoCrazyDots
+   Machine and human readable polyphonic music notation
+   without crazy dots.
+   Supports automated playing and auto-accompainment.
+
+   (c) 2017-2019 Antonio Bonifati aka Farmboy
+   <http://farmboymusicblog.wordpress.com>
+
+   This file is part of NoCrazyDots.
+
+   NoCrazyDots is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   NoCrazyDots is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with NoCrazyDots.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Playback timing statistics. The sender records the lateness of each
+   write in a buffer allocated beforehand, everything else is done after
+   playing, so that measuring does not make things worse. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "error.h"
+#include "midi.h"
+#include "timer.h"
+#include "stats.h"
+
+bool ncd_stats_report_enabled = false;
+const char *ncd_stats_csv = NULL;
+
+ncd_sample *ncd_samples;
+size_t ncd_samples_len, ncd_samples_size, ncd_samples_lost;
+
+// Allocate room for size samples and touch it, no page faults while playing
+void ncd_stats_init(size_t size) {
+  free(ncd_samples);
+  error_if((ncd_samples = malloc(size * sizeof(ncd_sample))) == NULL);
+  memset(ncd_samples, 0, size * sizeof(ncd_sample));
+  ncd_samples_size = size;
+  ncd_samples_len = ncd_samples_lost = 0;
+}
+
+static int cmp_late(const void *a, const void *b) {
+  int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+// p-th percentile of n sorted values
+#define PERCENTILE(sorted, n, p) ((sorted)[((n) - 1) * (p) / 100])
+
+/* Lateness histogram: a bucket for the writes that were early, one for
+   each power of 2 of us up to 2^(HISTBUCKETS - 3) and one for the rest.
+   Bucket b in between holds the lateness below 2^(b - 1) us. */
+#define HISTBUCKETS 20
+#define HISTWIDTH 50 // characters of the longest bar
+
+static int bucket(int64_t late) {
+  int b = 1;
+
+  if (late < 0) {
+    return 0;
+  }
+  while (b < HISTBUCKETS - 1 && late >= 1LL << (b - 1)) {
+    b++;
+  }
+  return b;
+}
+
+static const char *bucket_label(int b) {
+  static char label[16];
+
+  if (b == 0) {
+    return "early";
+  } else if (b == HISTBUCKETS - 1) {
+    sprintf(label, ">=%lld", 1LL << (HISTBUCKETS - 3));
+  } else {
+    sprintf(label, "<%lld", 1LL << (b - 1));
+  }
+  return label;
+}
+
+static void histogram(FILE *fp, int64_t *late, size_t n) {
+  size_t i, count[HISTBUCKETS] = {0}, most = 0;
+  int b, first = HISTBUCKETS, last = 0;
+
+  for (i = 0; i < n; i++) {
+    count[b = bucket(late[i])]++;
+    if (count[b] > most) {
+      most = count[b];
+    }
+    if (b < first) {
+      first = b;
+    }
+    if (b > last) {
+      last = b;
+    }
+  }
+
+  for (b = first; b <= last; b++) {
+    fprintf(fp, "%8s\t%zu\t", bucket_label(b), count[b]);
+    for (i = 0; i < (count[b] * HISTWIDTH + most - 1) / most; i++) {
+      fputc('#', fp);
+    }
+    fputc('\n', fp);
+  }
+}
+
+static void report(FILE *fp) {
+  int64_t *late, sum[MIDI_CHANNELS] = {0}, max[MIDI_CHANNELS] = {0};
+  size_t i, n = ncd_samples_len, count[MIDI_CHANNELS] = {0};
+  unsigned char channel;
+
+  error_if((late = malloc(n * sizeof(int64_t))) == NULL);
+  for (i = 0; i < n; i++) {
+    late[i] = ncd_samples[i].late;
+    for (channel = 0; channel < MIDI_CHANNELS; channel++) {
+      if (ncd_samples[i].channels & (1 << channel)) {
+        count[channel]++;
+        sum[channel] += late[i];
+        if (late[i] > max[channel]) {
+          max[channel] = late[i];
+        }
+      }
+    }
+  }
+  qsort(late, n, sizeof(int64_t), cmp_late);
+
+  fprintf(fp, "Lateness of %zu writes (us): p50 %lld  p95 %lld  p99 %lld  max %lld\n",
+    n, (long long)PERCENTILE(late, n, 50), (long long)PERCENTILE(late, n, 95),
+    (long long)PERCENTILE(late, n, 99), (long long)late[n - 1]);
+  if (ncd_samples_lost) {
+    fprintf(fp, "%zu more writes not measured\n", ncd_samples_lost);
+  }
+  histogram(fp, late, n);
+  fputs("channel\twrites\tmean\tmax\n", fp);
+  for (channel = 0; channel < MIDI_CHANNELS; channel++) {
+    if (count[channel]) {
+      fprintf(fp, "%hhu\t%zu\t%lld\t%lld\n", channel + 1, count[channel],
+        (long long)(sum[channel] / (int64_t)count[channel]),
+        (long long)max[channel]);
+    }
+  }
+
+  free(late);
+}
+
+static void dump_csv(const char *filename) {
+  FILE *fp;
+  size_t i;
+
+  error_if((fp = fopen(filename, "w")) == NULL);
+  fputs("deadline_us,actual_us,late_us,channels,bucket_us\n", fp);
+  for (i = 0; i < ncd_samples_len; i++) {
+    fprintf(fp, "%lld,%lld,%lld,0x%04hx,%s\n",
+      (long long)ncd_samples[i].deadline,
+      (long long)(ncd_samples[i].deadline + ncd_samples[i].late),
+      (long long)ncd_samples[i].late, ncd_samples[i].channels,
+      bucket_label(bucket(ncd_samples[i].late)));
+  }
+  error_if(fclose(fp) == EOF);
+}
+
+// To be called once playing is over
+void ncd_stats_report() {
+  size_t i, late = 0;
+  int64_t max = 0;
+
+  if (ncd_samples_len == 0) {
+    return;
+  }
+
+  if (ncd_stats_report_enabled) {
+    report(stderr);
+  } else {
+    for (i = 0; i < ncd_samples_len; i++) {
+      if (ncd_samples[i].late > LATENCY_WARN_THRESHOLD) {
+        late++;
+      }
+      if (ncd_samples[i].late > max) {
+        max = ncd_samples[i].late;
+      }
+    }
+    if (late) {
+      warning(0, "warning: %zu writes later than %d us, up to %lld us. Try -stats",
+        late, LATENCY_WARN_THRESHOLD, (long long)max);
+    }
+  }
+
+  if (ncd_stats_csv) {
+    dump_csv(ncd_stats_csv);
+  }
+}
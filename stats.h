@@ -0,0 +1,36 @@
+#ifndef NOCRAZYDOTS_STATS_H
+#define NOCRAZYDOTS_STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// One sample per write of the sender
+typedef struct {
+  int64_t deadline; // intended send time, in us from the start
+  int64_t late; // end of the write minus deadline, in us
+  unsigned short channels; // bit mask of the channels of the messages sent
+} ncd_sample;
+
+extern bool ncd_stats_report_enabled;
+// File name to dump all samples to as CSV, or NULL
+extern const char *ncd_stats_csv;
+
+extern ncd_sample *ncd_samples;
+extern size_t ncd_samples_len, ncd_samples_size, ncd_samples_lost;
+
+void ncd_stats_init(size_t size);
+void ncd_stats_report();
+
+// Cheap enough to be called by the sender, no allocation, no I/O
+#define NCD_STATS_RECORD(d, l, c) { \
+  if (ncd_samples_len < ncd_samples_size) { \
+    ncd_samples[ncd_samples_len].deadline = (d); \
+    ncd_samples[ncd_samples_len].late = (l); \
+    ncd_samples[ncd_samples_len++].channels = (c); \
+  } else { \
+    ncd_samples_lost++; \
+  } \
+}
+
+#endif
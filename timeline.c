@@ -0,0 +1,335 @@
+/*
+   NoCrazyDots
+   Machine and human readable polyphonic music notation
+   without crazy dots.
+   Supports automated playing and auto-accompainment.
+
+   (c) 2017-2019 Antonio Bonifati aka Farmboy
+   <http://farmboymusicblog.wordpress.com>
+
+   This file is part of NoCrazyDots.
+
+   NoCrazyDots is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   NoCrazyDots is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with NoCrazyDots.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Compile the MIDI-event queue into a flat timeline for playback.
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "error.h"
+#include "timeline.h"
+#include "queue.h"
+#include "midi.h"
+#include "player.h"
+#include "arena.h"
+#include "automation.h"
+
+ncd_tl_event *ncd_timeline;
+size_t ncd_timeline_len;
+
+ncd_tempo *ncd_tempo_map;
+size_t ncd_tempo_map_len;
+
+ncd_bar *ncd_bars;
+size_t ncd_bars_len;
+
+/* PCG32 random number generator (see pcg-random.org), small, fast and
+   the same everywhere, unlike rand(), so that a seed always gives the
+   same velocities. */
+#define PCG_MULT 6364136223846793005ULL
+#define PCG_INC 1442695040888963407ULL
+
+static uint64_t pcg_state;
+
+static uint32_t pcg32() {
+  uint64_t old = pcg_state;
+  uint32_t xorshifted = ((old >> 18) ^ old) >> 27, rot = old >> 59;
+
+  pcg_state = old * PCG_MULT + PCG_INC;
+  return (xorshifted >> rot) | (xorshifted << (-rot & 31));
+}
+
+static void pcg_seed(uint64_t seed) {
+  pcg_state = 0;
+  pcg32();
+  pcg_state += seed;
+  pcg32();
+}
+
+// A random velocity within ncd_percent_randomness% of velocity
+static unsigned char humanize(unsigned char velocity) {
+  int v = velocity - velocity * ncd_percent_randomness / 100
+    + pcg32() % (velocity * ncd_percent_randomness / 50 + 1);
+
+  // Keep it a valid note-on velocity
+  return v < 1 ? 1 : v > 127 ? 127 : v;
+}
+
+// Microseconds from the start of a tempo segment, rounded to the nearest.
+// 6E7 = 1000000 us * 60s
+#define SEGMENT_US(seg, t) ((seg)->us \
+  + (((t) - (seg)->time) * 60000000LL + (seg)->bpm * NCD_PPQ / 2) \
+    / ((seg)->bpm * NCD_PPQ))
+
+// Build the tempo map and give every record its absolute deadline.
+static void tempo_map() {
+  register ncd_tl_event *ev, *end = ncd_timeline + ncd_timeline_len;
+  register ncd_tempo *seg;
+
+  ncd_tempo_map_len = 1;
+  for (ev = ncd_timeline; ev < end; ev++) {
+    if (ev->kind == TL_TEMPO) {
+      ncd_tempo_map_len++;
+    }
+  }
+
+  seg = ncd_tempo_map = ncd_arena_alloc(&ncd_score_arena,
+    ncd_tempo_map_len * sizeof(ncd_tempo));
+  seg->time = 0;
+  seg->us = 0;
+  seg->bpm = DEFBPM;
+  for (ev = ncd_timeline; ev < end; ev++) {
+    ev->us = SEGMENT_US(seg, ev->time);
+    if (ev->kind == TL_TEMPO) {
+      // The new tempo applies from here on
+      seg++;
+      seg->time = ev->time;
+      seg->us = ev->us;
+      seg->bpm = ev->value;
+    }
+  }
+}
+
+// Absolute time in us of any score time.
+int64_t ncd_tempo_us(ncd_ticks time) {
+  size_t lo = 0, hi = ncd_tempo_map_len, mid;
+
+  // Find the last segment starting not later than time
+  while (hi - lo > 1) {
+    mid = (lo + hi) / 2;
+    if (ncd_tempo_map[mid].time <= time) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return SEGMENT_US(&ncd_tempo_map[lo], time);
+}
+
+/* Score time of an absolute time in us, the inverse of ncd_tempo_us:
+   the last tick not later than us, so that something happening just
+   before a bar line is not taken as part of that bar. */
+ncd_ticks ncd_tempo_ticks(int64_t us) {
+  size_t lo = 0, hi = ncd_tempo_map_len, mid;
+  ncd_tempo *seg;
+  ncd_ticks time;
+
+  while (hi - lo > 1) {
+    mid = (lo + hi) / 2;
+    if (ncd_tempo_map[mid].us <= us) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+
+  seg = &ncd_tempo_map[lo];
+  time = seg->time + (us - seg->us) * seg->bpm * NCD_PPQ / 60000000;
+  // ncd_tempo_us rounds to the nearest us, make up for it
+  while (SEGMENT_US(seg, time + 1) <= us) {
+    time++;
+  }
+  while (time > seg->time && SEGMENT_US(seg, time) > us) {
+    time--;
+  }
+  return time;
+}
+
+// Length of the whole score in us
+int64_t ncd_timeline_duration() {
+  return ncd_timeline_len ? ncd_timeline[ncd_timeline_len - 1].us : 0;
+}
+
+// Timeline being built by expand_ramps, grown with realloc
+static ncd_tl_event *expanded;
+static size_t expanded_len, expanded_size;
+// Time of the automation changes being expanded
+static int64_t expand_us;
+
+static ncd_tl_event *expand_append() {
+  if (expanded_len == expanded_size) {
+    expanded_size = expanded_size ? 2 * expanded_size : ncd_timeline_len + 64;
+    error_if((expanded = realloc(expanded,
+      expanded_size * sizeof(ncd_tl_event))) == NULL);
+  }
+  return &expanded[expanded_len++];
+}
+
+static void expand_send(ncd_midi_event msg, unsigned char size) {
+  ncd_tl_event *ev = expand_append();
+
+  ev->time = ncd_tempo_ticks(expand_us);
+  ev->us = expand_us;
+  ev->duration = 0;
+  memcpy(ev->msg, msg, sizeof(ncd_midi_event));
+  ev->size = size;
+  ev->kind = TL_MIDI;
+  ev->channel = msg[MIDI_STATUS] & 0x0F;
+  ev->tag = ' ';
+  ev->value = 0;
+}
+
+static void expand_until(int64_t us) {
+  while (ncd_auto_next() < us) {
+    expand_us = ncd_auto_next();
+    ncd_auto_run(expand_send);
+  }
+}
+
+/* Replace hairpins and slides with the volume and pitch wheel changes
+   they stand for, so that playing is only a matter of sending bytes
+   and every way to output a score gets the same curves. */
+static void expand_ramps() {
+  ncd_tl_event *ev, *end = ncd_timeline + ncd_timeline_len;
+  bool ramps = false;
+
+  for (ev = ncd_timeline; ev < end && !ramps; ev++) {
+    ramps = ev->kind == TL_HAIRPIN || ev->kind == TL_SLIDE;
+  }
+  if (!ramps) {
+    return;
+  }
+
+  expanded_len = 0;
+  ncd_auto_reset();
+  for (ev = ncd_timeline; ev < end; ev++) {
+    expand_until(ev->us);
+    switch (ev->kind) {
+      case TL_HAIRPIN:
+        ncd_auto_hairpin(ev);
+      break;
+
+      case TL_SLIDE:
+        ncd_auto_slide(ev);
+      break;
+
+      default:
+        *expand_append() = *ev;
+      break;
+    }
+  }
+  // Ramps going on after the last note, e.g. the release of a slide
+  expand_until(NCD_AUTO_IDLE);
+
+  ncd_timeline = ncd_arena_alloc(&ncd_score_arena,
+    expanded_len * sizeof(ncd_tl_event));
+  memcpy(ncd_timeline, expanded, expanded_len * sizeof(ncd_tl_event));
+  ncd_timeline_len = expanded_len;
+  free(expanded);
+  expanded = NULL;
+  expanded_size = 0;
+}
+
+/* Index the bar lines found while parsing. The first bar starts at 0.
+   The closing bar line of the score, where only the last notes end,
+   does not start a bar. */
+static void bar_index() {
+  ncd_ticks *times, end;
+  size_t len, i, pos = 0;
+  bool first;
+
+  times = ncd_queue_bars(&len);
+  end = ncd_timeline_len ? ncd_timeline[ncd_timeline_len - 1].time : 0;
+  while (len && times[len - 1] > 0 && times[len - 1] >= end) {
+    len--;
+  }
+  first = len == 0 || times[0] > 0;
+  ncd_bars_len = len + first;
+  ncd_bars = ncd_arena_alloc(&ncd_score_arena, ncd_bars_len * sizeof(ncd_bar));
+
+  for (i = 0; i < ncd_bars_len; i++) {
+    ncd_bars[i].time = first ? (i ? times[i - 1] : 0) : times[i];
+    while (pos < ncd_timeline_len && ncd_timeline[pos].time < ncd_bars[i].time) {
+      pos++;
+    }
+    ncd_bars[i].pos = pos;
+  }
+}
+
+/* Flatten the queue, which is consumed, into one array sorted by time
+   and decode each event once and for all, randomizing velocities too.
+   The linked queue is only needed while parsing. */
+void ncd_timeline_build() {
+  ncd_node *node;
+  ncd_event *event;
+  register ncd_tl_event *ev;
+  register unsigned char i, status;
+
+  ev = ncd_timeline = ncd_arena_alloc(&ncd_score_arena,
+    ncd_queue_events_len() * sizeof(ncd_tl_event));
+  pcg_seed(ncd_random_seed);
+
+  while ((node = ncd_queue_pop_node())) {
+    for (i = 0; i < node->events_len; i++, ev++) {
+      event = &(node->events[i]);
+      status = event->msg[MIDI_STATUS] & 0xF0;
+
+      ev->time = node->start_time;
+      ev->duration = event->duration;
+      memcpy(ev->msg, event->msg, sizeof(ncd_midi_event));
+      ev->size = 0;
+      ev->channel = event->msg[MIDI_STATUS] & 0x0F;
+      ev->tag = event->tag;
+      ev->value = 0;
+
+      // Warning: non standard pseudo-events, see ncd_midi_set_tempo,
+      // ncd_start_hairpin and ncd_slide
+      if (event->msg[MIDI_STATUS] == MIDI_META
+          && event->msg[MIDI_DATA1] == MIDI_SET_TEMPO) {
+        ev->kind = TL_TEMPO;
+        ev->value = event->msg[MIDI_DATA2];
+      } else if (status == MIDI_CONTROLLER
+                 && event->msg[MIDI_DATA1] == MIDI_EXPRESSION_MSB) {
+        ev->kind = TL_HAIRPIN;
+        ev->value = event->msg[MIDI_DATA2] & 0x7F;
+        if (!(event->msg[MIDI_DATA2] & 0x80)) { // decrescendo
+          ev->value = -ev->value;
+        }
+      } else if (status == MIDI_PITCH_WHEEL) {
+        ev->kind = TL_SLIDE;
+        ev->value = (signed char)event->msg[MIDI_DATA1];
+      } else {
+        ev->kind = TL_MIDI;
+        ev->size = ncd_midi_event_size(ev->msg);
+        if (ev->channel != DRUMCHANNEL
+             && (status == MIDI_NOTEON || status == MIDI_NOTEOFF)) {
+          ev->msg[MIDI_DATA1] += ncd_trans_semitones;
+        }
+        // Velocity 0 is a note-off
+        if (ncd_percent_randomness && status == MIDI_NOTEON
+            && ev->msg[MIDI_DATA2]) {
+          ev->msg[MIDI_DATA2] = humanize(ev->msg[MIDI_DATA2]);
+        }
+      }
+    }
+  }
+
+  ncd_timeline_len = ev - ncd_timeline;
+
+  tempo_map();
+  expand_ramps();
+  bar_index();
+}
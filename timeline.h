@@ -0,0 +1,65 @@
+#ifndef NOCRAZYDOTS_TIMELINE_H
+#define NOCRAZYDOTS_TIMELINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "queue.h"
+
+// Default number of beats per minute. Each beat is a quarter note.
+#define DEFBPM 60
+
+// What a timeline record stands for, decoded once after parsing
+enum {
+  TL_MIDI, // a message to send as it is
+  TL_TEMPO, // value is the new bpm
+  // These two are expanded into TL_MIDI records once the timeline is built
+  TL_HAIRPIN, // value is the percentage, negative for decrescendo
+  TL_SLIDE // value is the number of semitones, negative sliding down
+};
+
+/* One record per queue event, in a single array sorted by time, so
+   that the player streams linearly through memory. */
+typedef struct {
+  ncd_ticks time;
+  int64_t us; // absolute deadline from the start of the score, in us
+  ncd_ticks duration; // of hairpins and slides
+  ncd_midi_event msg; // ready to send, already transposed
+  unsigned char size; // number of bytes of msg to send, 0 for pseudo-events
+  unsigned char kind;
+  unsigned char channel;
+  char tag; // ' ' (space) for note-unrelated events
+  short value; // see the record kinds above
+} ncd_tl_event;
+
+extern ncd_tl_event *ncd_timeline;
+extern size_t ncd_timeline_len;
+
+/* The tempo map: one segment per tempo change, the first one starting
+   at time 0 with DEFBPM, so that any score time can be converted to an
+   absolute time in us without accumulating rounding errors. */
+typedef struct {
+  ncd_ticks time;
+  int64_t us;
+  unsigned char bpm;
+} ncd_tempo;
+
+extern ncd_tempo *ncd_tempo_map;
+extern size_t ncd_tempo_map_len;
+
+/* Where each bar starts, in score time and as the position of its first
+   record in the timeline, so that playing can start from any bar right
+   away. Bar n (counting from 1) starts at ncd_bars[n - 1]. */
+typedef struct {
+  ncd_ticks time;
+  size_t pos;
+} ncd_bar;
+
+extern ncd_bar *ncd_bars;
+extern size_t ncd_bars_len;
+
+void ncd_timeline_build();
+int64_t ncd_tempo_us(ncd_ticks time);
+ncd_ticks ncd_tempo_ticks(int64_t us);
+int64_t ncd_timeline_duration();
+
+#endif
@@ -0,0 +1,100 @@
+/*
+   NoCrazyDots
+   Machine and human readable polyphonic music notation
+   without crazy dots.
+   Supports automated playing and auto-accompainment.
+
+   (c) 2017-2019 Antonio Bonifati aka Farmboy
+   <http://farmboymusicblog.wordpress.com>
+
+   This file is part of NoCrazyDots.
+
+   NoCrazyDots is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   NoCrazyDots is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with NoCrazyDots.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Sleep to absolute deadlines on the monotonic clock.
+
+#include <time.h>
+#include <errno.h>
+#include "timer.h"
+
+unsigned ncd_timer_spin = DEFSPIN;
+int64_t ncd_timer_overshoot = 0;
+
+// Monotonic time of deadline 0, in us
+static int64_t timer_origin;
+
+static int64_t monotonic_us() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void ncd_timer_start() {
+  timer_origin = monotonic_us();
+}
+
+// Move the origin so that deadline us is now
+void ncd_timer_sync(int64_t us) {
+  timer_origin = monotonic_us() - us;
+}
+
+// Same, but for deadline us to be at clock (see ncd_timer_clock)
+void ncd_timer_sync_at(int64_t us, int64_t clock) {
+  timer_origin = clock - us;
+}
+
+// Time in us unaffected by ncd_timer_start and ncd_timer_sync
+int64_t ncd_timer_clock() {
+  return monotonic_us();
+}
+
+int64_t ncd_timer_now() {
+  return monotonic_us() - timer_origin;
+}
+
+/* Sleep until deadline (in us since the origin), busy waiting for
+   the last ncd_timer_spin us. The sleep ends ncd_timer_overshoot us
+   earlier, since the kernel wakes us up late by about that much, and
+   the estimate follows what is measured. Return how late we actually
+   woke up, which is not reported here, not to make it worse. */
+int64_t ncd_timer_sleep_until(int64_t deadline) {
+  int64_t target = timer_origin + deadline,
+    wake = target - ncd_timer_spin - ncd_timer_overshoot;
+  struct timespec ts;
+
+  if (wake > monotonic_us()) {
+    ts.tv_sec = wake / 1000000;
+    ts.tv_nsec = wake % 1000000 * 1000;
+    // Deadlines are absolute, an interrupted sleep can be just restarted
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+    ncd_timer_adapt(&ncd_timer_overshoot, monotonic_us() - wake);
+  }
+  // Woken up ahead of time on purpose
+  while (monotonic_us() < target);
+
+  return monotonic_us() - target;
+}
+
+/* Move the estimate towards the measure. At least by 1us, otherwise an
+   estimate less than ADAPTRATE us off would never be corrected. */
+void ncd_timer_adapt(int64_t *estimate, int64_t measure) {
+  int64_t step = (measure - *estimate) / ADAPTRATE;
+
+  if (step == 0) {
+    step = (measure > *estimate) - (measure < *estimate);
+  }
+  *estimate += step;
+}
@@ -1,10 +1,7 @@
 #ifndef NOCRAZYDOTS_TIMER_H
 #define NOCRAZYDOTS_TIMER_H
 
-#include <unistd.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <sys/time.h>
+#include <stdint.h>
 
 /* An implementation based on MIDI ticks rather than this simple
    stopwatch may allow synchronization with other MIDI devices. But I
@@ -12,49 +9,29 @@
    a MIDI message. It looks like this feature is not supported neither
    by the MIDI standard, nor by my keyboard implementation of it. */
 
-struct timeval ncd_timer_start = (struct timeval){0},
-  ncd_timer_stop = (struct timeval){0};
-float ncd_time_elapsed = 0;
-
 // 5ms (5000us) latency is the smallest a human being can detect.
 #define LATENCY_WARN_THRESHOLD 5000 // In us
 
-/* Latency correction addend. Needed because the latency correction
-   algorithm below (see macro CHRONOSLEEP) introduces some latency too.
-   Best value must be found by experiment. Faster computers will require
-   smaller value. Record a long piece and compare effective with
-   theoretical length. If the former is significantly higher, try to
-   increment this value until they match. I advice to make use of the
-   binary search algorithm to find out a sufficient approximation
-   of the right correction with the least number of tries.
-   Must be less than LATENCY_WARN_THRESHOLD to make sense. */
-#define LATENCY_CORRECTION 2.75 // In us
-
-// Estimate of latency piled up so far.
-float ncd_latency = 0;
-
-#define MICROSEC(s) (s.tv_sec * 1000000 + s.tv_usec)
-#define STOPWATCH_RESET() (ncd_timer_start = ncd_timer_stop = (struct timeval){0}, ncd_time_elapsed = 0)
-#define STOPWATCH_START() gettimeofday(&ncd_timer_start, NULL)
-#define STOPWATCH_STOP() gettimeofday(&ncd_timer_stop, NULL)
-#define STOPWATCH_READ() (MICROSEC(ncd_timer_stop) - MICROSEC(ncd_timer_start))
-
-#define CHRONOSLEEP(us) { \
-  float drift, wait_time; \
-  STOPWATCH_STOP(); \
-  drift = STOPWATCH_READ() - ncd_time_elapsed + (ncd_latency += LATENCY_CORRECTION); \
-  if (drift > LATENCY_WARN_THRESHOLD) { \
-    fprintf(stderr, "Warning: %d us latency\n", (int)drift); \
-  } \
-  ncd_time_elapsed += us; \
-  /* Auto-correct most of the delay (latency due to computation)
-     by shortening notes and other events to make up */ \
-  wait_time = (us) - drift; \
-  if (wait_time > 0) { \
-    /* Truncate wait_time, do not round it. It is only up to half of
-       microsec difference, probably not worthing the effort. */ \
-    usleep(wait_time); \
-  } \
-}
+/* Default number of us to busy wait before each deadline instead of
+   sleeping, to make up for the kernel wake-up latency. Costs CPU time,
+   so it is off unless asked for. */
+#define DEFSPIN 0
+
+extern unsigned ncd_timer_spin;
+
+// Estimate of how late the kernel wakes us up (in us), see -calibrate
+extern int64_t ncd_timer_overshoot;
+
+/* Estimates move towards each new measure by 1/ADAPTRATE of the way,
+   so that they follow the load of the machine but not single hiccups. */
+#define ADAPTRATE 16
+
+void ncd_timer_start();
+void ncd_timer_sync(int64_t us);
+void ncd_timer_sync_at(int64_t us, int64_t clock);
+int64_t ncd_timer_clock();
+int64_t ncd_timer_now();
+int64_t ncd_timer_sleep_until(int64_t deadline);
+void ncd_timer_adapt(int64_t *estimate, int64_t measure);
 
 #endif